@@ -0,0 +1,16 @@
+/* Boost.Preprocessor, which exercises deep recursion and very large macro tables. */
+
+#include <boost/preprocessor/seq/for_each.hpp>
+#include <boost/preprocessor/seq/to_tuple.hpp>
+#include <boost/preprocessor/repetition/repeat.hpp>
+#include <boost/preprocessor/repetition/enum_params.hpp>
+#include <boost/preprocessor/arithmetic/add.hpp>
+
+#define MEMBER(r, data, elem) data elem;
+#define DECL(z, n, text) text ## n = n;
+
+struct members { BOOST_PP_SEQ_FOR_EACH(MEMBER, int, (a)(b)(c)(d)) };
+BOOST_PP_SEQ_TO_TUPLE((1)(2)(3))
+BOOST_PP_REPEAT(8, DECL, int x)
+template <BOOST_PP_ENUM_PARAMS(4, class T)> struct tuple;
+int sum = BOOST_PP_ADD(7, 9);
@@ -0,0 +1,36 @@
+/* A self-contained macro library: token pasting, variadic argument counting and X-macro tables. */
+
+#define CAT(a, b) CAT_I(a, b)
+#define CAT_I(a, b) a ## b
+
+#define COUNT(...) COUNT_I(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define COUNT_I(_1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+
+#define APPLY(m, ...) CAT(APPLY_, COUNT(__VA_ARGS__))(m, __VA_ARGS__)
+#define APPLY_1(m, a) m(a)
+#define APPLY_2(m, a, ...) m(a) APPLY_1(m, __VA_ARGS__)
+#define APPLY_3(m, a, ...) m(a) APPLY_2(m, __VA_ARGS__)
+#define APPLY_4(m, a, ...) m(a) APPLY_3(m, __VA_ARGS__)
+#define APPLY_5(m, a, ...) m(a) APPLY_4(m, __VA_ARGS__)
+#define APPLY_6(m, a, ...) m(a) APPLY_5(m, __VA_ARGS__)
+#define APPLY_7(m, a, ...) m(a) APPLY_6(m, __VA_ARGS__)
+#define APPLY_8(m, a, ...) m(a) APPLY_7(m, __VA_ARGS__)
+
+#define COLORS(X) \
+    X(RED, 0xff0000) \
+    X(GREEN, 0x00ff00) \
+    X(BLUE, 0x0000ff) \
+    X(CYAN, 0x00ffff) \
+    X(MAGENTA, 0xff00ff) \
+    X(YELLOW, 0xffff00)
+
+#define ENUM_ENTRY(name, value) CAT(COLOR_, name) = value,
+#define NAME_ENTRY(name, value) #name,
+#define FIELD(type) type CAT(field_, type);
+
+enum color { COLORS(ENUM_ENTRY) };
+static char const* color_names[] = { COLORS(NAME_ENTRY) };
+
+struct record { APPLY(FIELD, int, long, short, char, float, double, unsigned, signed) };
+struct small { APPLY(FIELD, int, char) };
+int counts[] = { COUNT(a), COUNT(a, b, c), COUNT(a, b, c, d, e, f, g, h) };
@@ -0,0 +1,191 @@
+
+#include "preprocessor.hpp"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <streambuf>
+#include <iomanip>
+#include <list>
+#include <map>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+
+// Measures how long each interactive command takes to get back to the prompt. Every corpus file is stepped
+// through with the commands in the .cmds file next to it, fed to the prompt in place of linenoise, with the
+// prompt's own output thrown away.
+
+namespace po = boost::program_options;
+
+using clock_type = std::chrono::steady_clock;
+
+
+// Commands are grouped by what they do rather than by their arguments, except that stepping once and
+// stepping many times are told apart.
+static std::string command_kind(std::string const& command) {
+    std::istringstream ss(command);
+    auto word = std::string();
+    auto argument = std::string();
+    ss >> word >> argument;
+
+    if (word == "s" || word == "step") return argument.empty() ? "step" : "step N";
+    if (word == "c" || word == "continue") return "continue";
+    if (word == "bt" || word == "backtrace") return "bt";
+    if (word == "ft" || word == "forwardtrace") return "ft";
+    if (word == "e" || word == "expand") return "expand";
+    if (word == "b") return "break";
+    if (word == "d") return "delete";
+    return word;
+}
+
+struct scripted_session {
+    std::vector<std::string> commands;
+    std::size_t next = 0;
+
+    std::string in_flight;
+    clock_type::time_point issued;
+
+    std::map<std::string, std::vector<double>>* samples = nullptr;
+};
+
+static scripted_session* session = nullptr;
+
+// Called whenever the prompt wants a command, which is when the previous one has finished.
+static char* read_scripted_line(char const*) {
+    auto now = clock_type::now();
+    if (!session->in_flight.empty() && session->samples) {
+        (*session->samples)[session->in_flight].push_back(std::chrono::duration<double, std::milli>(now - session->issued).count());
+    }
+
+    auto const& command = session->next < session->commands.size() ? session->commands[session->next++] : std::string("q");
+    session->in_flight = command_kind(command);
+    session->issued = clock_type::now();
+    return strdup(command.c_str());
+}
+
+struct null_buffer : std::streambuf {
+    int overflow(int c) override {
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(char const*, std::streamsize n) override {
+        return n;
+    }
+};
+
+static void run_session(std::string const& input_file, std::vector<std::string> const& includes, std::vector<std::string> const& commands,
+                        std::map<std::string, std::vector<double>>* samples) {
+    auto instring = std::string();
+    {
+        std::ifstream in(input_file);
+        instring.assign(std::istreambuf_iterator<char>(in.rdbuf()), std::istreambuf_iterator<char>());
+    }
+
+    auto script = scripted_session();
+    script.commands = commands;
+    script.samples = samples;
+    session = &script;
+
+    auto server_state = ppstep::server_state<ppstep::token_sequence_type>();
+    auto client = ppstep::client<ppstep::token_type, ppstep::token_sequence_type>(server_state);
+    auto server = ppstep::server<ppstep::token_type, ppstep::token_sequence_type>(server_state, client);
+    ppstep::context_type ctx(instring.begin(), instring.end(), input_file.c_str(), server);
+
+    server_state.macros->clear();
+    ctx.set_language(ppstep::language);
+    for (auto const& path : includes) {
+        ctx.add_include_path(path.c_str());
+        ctx.add_sysinclude_path(path.c_str());
+    }
+
+    auto first = ctx.begin();
+    auto last = ctx.end();
+    try {
+        server.start(ctx);
+        while (first != last) {
+            server.lexed_token(ctx, *first);
+            ++first;
+        }
+        server.complete(ctx);
+    } catch (ppstep::session_terminate const&) {
+        ;
+    }
+
+    session = nullptr;
+}
+
+static double percentile(std::vector<double> const& sorted, double p) {
+    auto rank = static_cast<std::size_t>(p / 100 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+int main(int argc, char const** argv) {
+    po::options_description desc("ppstep_bench");
+    desc.add_options()
+        ("help,h", "produce help message")
+        ("include,I", po::value<std::vector<std::string>>()->composing(), "include path")
+        ("repeat", po::value<std::size_t>()->default_value(20), "measured runs of each script, after one warm-up run")
+        ("input-file", po::value<std::vector<std::string>>()->required(), "corpus files, each with a .cmds script next to it");
+
+    po::positional_options_description p;
+    p.add("input-file", -1);
+
+    po::variables_map args;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), args);
+        if (args.count("help")) {
+            std::cerr << desc << std::endl;
+            return 0;
+        }
+        po::notify(args);
+    } catch (std::exception const& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+
+    auto includes = args.count("include") ? args["include"].as<std::vector<std::string>>() : std::vector<std::string>();
+    auto repeat = args["repeat"].as<std::size_t>();
+
+    ppstep::detail::read_line() = read_scripted_line;
+
+    auto samples = std::map<std::string, std::vector<double>>();
+    auto discard = null_buffer();
+    for (auto const& input_file : args["input-file"].as<std::vector<std::string>>()) {
+        auto script_file = boost::filesystem::path(input_file).replace_extension(".cmds").string();
+        std::ifstream script_in(script_file);
+        if (!script_in) {
+            std::cerr << "error: cannot open command script " << script_file << std::endl;
+            return 1;
+        }
+
+        auto commands = std::vector<std::string>();
+        for (std::string line; std::getline(script_in, line);) {
+            if (!line.empty()) commands.push_back(line);
+        }
+
+        auto* console = std::cout.rdbuf(&discard);
+        for (std::size_t i = 0; i <= repeat; ++i) {
+            run_session(input_file, includes, commands, i == 0 ? nullptr : &samples);
+        }
+        std::cout.rdbuf(console);
+    }
+
+    std::cout << std::left << std::setw(12) << "command" << std::right << std::setw(8) << "count"
+              << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms" << std::setw(10) << "p99 ms" << std::setw(10) << "max ms" << '\n';
+    for (auto& [kind, times] : samples) {
+        std::sort(times.begin(), times.end());
+        std::cout << std::left << std::setw(12) << kind << std::right << std::setw(8) << times.size() << std::fixed << std::setprecision(3)
+                  << std::setw(10) << percentile(times, 50) << std::setw(10) << percentile(times, 90)
+                  << std::setw(10) << percentile(times, 99) << std::setw(10) << times.back() << '\n';
+    }
+    return 0;
+}
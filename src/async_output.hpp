@@ -0,0 +1,136 @@
+#ifndef PPSTEP_ASYNC_OUTPUT_HPP
+#define PPSTEP_ASYNC_OUTPUT_HPP
+
+#include <string>
+#include <streambuf>
+#include <ostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cerrno>
+
+#include <unistd.h>
+
+namespace ppstep {
+    // Takes over a stream for as long as it lives and writes what is sent to it from a background thread,
+    // in large blocks. Output collects in one buffer while the other is being written; when the writer is
+    // still busy the collecting buffer just keeps growing, so whoever writes to the stream never waits for
+    // I/O. Flushing the stream (std::endl included) does not force a write; flush() does, and so does
+    // destruction.
+    struct async_output : std::streambuf {
+        static constexpr std::size_t handoff_size = 1 << 16;
+
+        async_output(std::ostream& os, int fd)
+            : os(os), fd(fd), writing(false), stopping(false), failed(false) {
+            os.flush();
+            previous = os.rdbuf(this);
+            front.reserve(handoff_size * 2);
+            back.reserve(handoff_size * 2);
+            writer = std::thread([this]() { work(); });
+        }
+
+        ~async_output() {
+            flush();
+            os.rdbuf(previous);
+            {
+                auto lock = std::lock_guard<std::mutex>(mutex);
+                stopping = true;
+            }
+            wake_writer.notify_one();
+            writer.join();
+        }
+
+        async_output(async_output const&) = delete;
+        async_output& operator=(async_output const&) = delete;
+
+        // Waits until everything sent so far has been written.
+        void flush() {
+            auto lock = std::unique_lock<std::mutex>(mutex);
+            written.wait(lock, [&]() { return !writing; });
+            if (front.empty()) return;
+
+            std::swap(front, back);
+            writing = true;
+            wake_writer.notify_one();
+            written.wait(lock, [&]() { return !writing; });
+        }
+
+    protected:
+        int_type overflow(int_type c) override {
+            if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+
+            front += traits_type::to_char_type(c);
+            if (front.size() >= handoff_size) hand_off();
+            return c;
+        }
+
+        std::streamsize xsputn(char const* data, std::streamsize size) override {
+            front.append(data, static_cast<std::size_t>(size));
+            if (front.size() >= handoff_size) hand_off();
+            return size;
+        }
+
+        int sync() override {
+            return failed ? -1 : 0;
+        }
+
+    private:
+        void hand_off() {
+            auto lock = std::unique_lock<std::mutex>(mutex, std::try_to_lock);
+            if (!lock || writing) return;
+
+            std::swap(front, back);
+            writing = true;
+            wake_writer.notify_one();
+        }
+
+        void work() {
+            auto lock = std::unique_lock<std::mutex>(mutex);
+            for (;;) {
+                wake_writer.wait(lock, [&]() { return writing || stopping; });
+                if (!writing) return;
+
+                lock.unlock();
+                bool ok = write_all(back.data(), back.size());
+                back.clear();
+                lock.lock();
+
+                if (!ok) failed = true;
+                writing = false;
+                written.notify_all();
+            }
+        }
+
+        bool write_all(char const* data, std::size_t size) {
+            while (size) {
+                auto n = ::write(fd, data, size);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                data += n;
+                size -= static_cast<std::size_t>(n);
+            }
+            return true;
+        }
+
+        std::ostream& os;
+        std::streambuf* previous;
+        int fd;
+
+        std::string front;
+        std::string back;
+
+        std::mutex mutex;
+        std::condition_variable wake_writer;
+        std::condition_variable written;
+        bool writing;
+        bool stopping;
+        std::atomic<bool> failed;
+
+        std::thread writer;
+    };
+}
+
+#endif // PPSTEP_ASYNC_OUTPUT_HPP
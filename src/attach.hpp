@@ -0,0 +1,179 @@
+#ifndef PPSTEP_ATTACH_HPP
+#define PPSTEP_ATTACH_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <iomanip>
+#include <cerrno>
+
+#include <signal.h>
+
+#include <boost/program_options.hpp>
+#include <boost/interprocess/exceptions.hpp>
+
+#include "event_feed.hpp"
+
+namespace ppstep {
+    // What an attached viewer knows about the session, built from the events it has read so far.
+    struct feed_index {
+        struct macro_stats {
+            std::size_t calls = 0;
+            std::size_t expansions = 0;
+            std::size_t rescans = 0;
+        };
+
+        void add(feed::event const& e) {
+            ++events;
+            switch (e.kind) {
+                case feed::event_kind::called: ++macros[e.name].calls; break;
+                case feed::event_kind::expanded: ++macros[e.name].expansions; break;
+                case feed::event_kind::rescanned: ++macros[e.name].rescans; break;
+                case feed::event_kind::stopped: ++stops; break;
+                default: break;
+            }
+        }
+
+        void print(std::ostream& os, std::size_t max_macros = 10) const {
+            os << events << " events, " << dropped << " dropped, " << stops << " stops\n";
+
+            auto ranked = std::vector<std::pair<std::string, macro_stats>>(macros.begin(), macros.end());
+            std::sort(ranked.begin(), ranked.end(), [](auto const& a, auto const& b) {
+                return a.second.calls != b.second.calls ? a.second.calls > b.second.calls : a.first < b.first;
+            });
+            if (ranked.size() > max_macros) ranked.resize(max_macros);
+
+            for (auto const& [name, stats] : ranked) {
+                os << std::setw(10) << stats.calls << std::setw(10) << stats.expansions << std::setw(10) << stats.rescans
+                   << "  " << name << '\n';
+            }
+            os << std::flush;
+        }
+
+        std::unordered_map<std::string, macro_stats> macros;
+        std::size_t events = 0;
+        std::size_t dropped = 0;
+        std::size_t stops = 0;
+    };
+
+    inline void print_feed_event(std::ostream& os, feed::event const& e) {
+        switch (e.kind) {
+            case feed::event_kind::stopped:
+                os << "-- stopped (" << e.text << ") at depth " << e.depth << " --\n";
+                return;
+            case feed::event_kind::frame:
+            case feed::event_kind::rescan_frame:
+                os << std::setw(4) << e.depth << ": " << e.text << (e.truncated ? " ..." : "")
+                   << (e.kind == feed::event_kind::rescan_frame ? " (rescanning)" : "") << '\n';
+                return;
+            default:
+                os << std::string(2 * std::min<std::size_t>(e.depth, 40), ' ') << std::left << std::setw(10) << feed::kind_name(e.kind)
+                   << std::right << e.name << ": " << e.text << (e.truncated ? " ..." : "") << '\n';
+                return;
+        }
+    }
+
+    // `ppstep attach NAME`: follows the events of the session publishing to the named feed until it ends.
+    inline int attach_main(int argc, char const** argv) {
+        namespace po = boost::program_options;
+
+        po::options_description desc("ppstep attach");
+        desc.add_options()
+            ("help,h", "produce help message")
+            ("grep", po::value<std::string>(), "only show events whose macro name or tokens contain the given text")
+            ("stats", "show the most called macros once a second instead of the events themselves")
+            ("follow", "skip the events published before attaching")
+            ("feed", po::value<std::string>()->required(), "the name given to --feed by the session");
+
+        po::positional_options_description p;
+        p.add("feed", 1);
+
+        po::variables_map args;
+        try {
+            po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), args);
+            if (args.count("help")) {
+                std::cerr << desc << std::endl;
+                return 1;
+            }
+            po::notify(args);
+        } catch (std::exception const& e) {
+            std::cerr << "error: " << e.what() << std::endl;
+            std::cerr << desc << std::endl;
+            return 1;
+        }
+
+        auto const& name = args["feed"].as<std::string>();
+        auto subscriber = std::optional<event_subscriber>();
+        try {
+            subscriber.emplace(name);
+        } catch (boost::interprocess::interprocess_exception const& e) {
+            std::cerr << "error: cannot open feed " << name << ": " << e.what() << std::endl;
+            return 1;
+        }
+        if (!subscriber->compatible()) {
+            std::cerr << "error: " << name << " is not a feed from this version of ppstep" << std::endl;
+            return 1;
+        }
+
+        auto pattern = args.count("grep") ? args["grep"].as<std::string>() : std::string();
+        bool stats = args.count("stats");
+
+        auto index = feed_index();
+        auto cursor = args.count("follow") ? subscriber->published() : subscriber->oldest();
+        auto last_report = std::chrono::steady_clock::now();
+
+        // frames belong to the stop before them, so they are shown or hidden with it
+        bool showing_stop = false;
+
+        for (;;) {
+            // reading closed first means nothing published after it is missed
+            bool closed = subscriber->closed();
+            auto newest = subscriber->published();
+            if (newest - cursor > feed::capacity) {
+                index.dropped += newest - feed::capacity - cursor;
+                cursor = newest - feed::capacity;
+            }
+
+            for (; cursor < newest; ++cursor) {
+                auto e = subscriber->read(cursor);
+                if (!e) {
+                    ++index.dropped;
+                    continue;
+                }
+                index.add(*e);
+                if (stats) continue;
+
+                bool is_frame = e->kind == feed::event_kind::frame || e->kind == feed::event_kind::rescan_frame;
+                if (e->kind == feed::event_kind::stopped) showing_stop = true;
+                else if (!is_frame) showing_stop = false;
+
+                if (!showing_stop && !pattern.empty() && e->name.find(pattern) == std::string::npos
+                        && e->text.find(pattern) == std::string::npos) {
+                    continue;
+                }
+                print_feed_event(std::cout, *e);
+            }
+            std::cout << std::flush;
+
+            if (closed || (::kill(static_cast<pid_t>(subscriber->pid()), 0) != 0 && errno == ESRCH)) break;
+
+            auto now = std::chrono::steady_clock::now();
+            if (stats && now - last_report >= std::chrono::seconds(1)) {
+                index.print(std::cout);
+                std::cout << '\n';
+                last_report = now;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        if (stats) index.print(std::cout);
+        std::cerr << "session ended" << (index.dropped ? " (" + std::to_string(index.dropped) + " events were overwritten before they could be read)" : "") << std::endl;
+        return 0;
+    }
+}
+
+#endif // PPSTEP_ATTACH_HPP
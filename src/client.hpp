@@ -11,11 +11,20 @@
 #include <stdexcept>
 #include <algorithm>
 #include <set>
+#include <map>
+#include <unordered_set>
+#include <list>
 #include <functional>
 
 #include "server_fwd.hpp"
 #include "client_fwd.hpp"
 #include "view.hpp"
+#include "protocol.hpp"
+#include "compact_token.hpp"
+#include "token_automaton.hpp"
+#include "expansion_recording.hpp"
+#include "hook_timings.hpp"
+#include "progress.hpp"
 #include "utils.hpp"
 
 namespace ppstep {
@@ -61,6 +70,12 @@ namespace ppstep {
 
                 print_token_range(os, sub_end, tokens.end()) << ansi::reset << std::endl;
             }
+
+            void write(json_writer& w, ContainerT const& tokens) const {
+                w.key("start").value(start).key("end").value(end);
+                w.key("tokens").tokens(std::next(tokens.begin(), start), std::next(tokens.begin(), end));
+                static_cast<DerivedT const*>(this)->write_details(w);
+            }
             
             std::size_t start, end;
         };
@@ -79,6 +94,10 @@ namespace ppstep {
                 print_token_container(os, tokens) << ansi::reset << std::endl;
             }
 
+            void write_details(json_writer& w) const {
+                w.key("event").value("called").key("macro").tokens(tokens);
+            }
+
             ContainerT tokens;
         };
         
@@ -95,6 +114,10 @@ namespace ppstep {
                 os << "expanded macro " << ansi::white_bg << ansi::black_fg;
                 print_token_container(os, initial) << ansi::reset << std::endl;
             }
+
+            void write_details(json_writer& w) const {
+                w.key("event").value("expanded").key("macro").tokens(initial);
+            }
             
             ContainerT initial;
         };
@@ -113,10 +136,35 @@ namespace ppstep {
                 print_token_container(os, initial) << ansi::reset << "\ncaused by " << ansi::white_bg << ansi::black_fg;
                 print_token_container(os, cause) << ansi::reset << std::endl;
             }
+
+            void write_details(json_writer& w) const {
+                w.key("event").value("rescanned").key("macro").tokens(initial).key("cause").tokens(cause);
+            }
             
             ContainerT cause, initial;
         };
         
+        template <class ContainerT>
+        struct collapsed : formatting_event<ContainerT, collapsed<ContainerT>> {
+            collapsed(ContainerT initial, std::size_t start, std::size_t end)
+                : formatting_event<ContainerT, collapsed<ContainerT>>(start, end), initial(std::move(initial)) {}
+
+            void format(std::ostream& os) const {
+                os << ansi::blue_bg << ansi::white_fg;
+            }
+
+            void explain(std::ostream& os) const {
+                os << "expanded and rescanned macro " << ansi::white_bg << ansi::black_fg;
+                print_token_container(os, initial) << ansi::reset << " in one step" << std::endl;
+            }
+
+            void write_details(json_writer& w) const {
+                w.key("event").value("collapsed").key("macro").tokens(initial);
+            }
+
+            ContainerT initial;
+        };
+
         template <class ContainerT>
         struct lexed {
             void print(std::ostream& os, ContainerT const& tokens) const {
@@ -127,6 +175,12 @@ namespace ppstep {
             void explain(std::ostream& os) const {
                 os << "lexed tokens ?" << std::endl;
             }
+
+            void write(json_writer& w, ContainerT const& tokens) const {
+                w.key("event").value("lexed");
+                w.key("start").value(tokens.size() - 1).key("end").value(tokens.size());
+                w.key("tokens").tokens(std::prev(tokens.end()), tokens.end());
+            }
         };
     }
     
@@ -136,24 +190,23 @@ namespace ppstep {
             events::call<ContainerT>,
             events::expanded<ContainerT>,
             events::rescanned<ContainerT>,
+            events::collapsed<ContainerT>,
             events::lexed<ContainerT>>;
     
     template <class ContainerT>
     struct offset_container {
         using iterator = typename ContainerT::const_iterator;
         
-        offset_container(ContainerT&& tokens, iterator&& start) : tokens(std::move(tokens)), start(std::move(start)) {}
-        
-        offset_container(ContainerT&& tokens) : tokens(std::move(tokens)), start(this->tokens.end()) {}
+        offset_container(ContainerT&& tokens, std::size_t start) : tokens(std::move(tokens)), start(start) {}
         
         offset_container(offset_container<ContainerT> const&) = delete;
         
         std::optional<std::pair<iterator, iterator>> find_pattern(ContainerT const& pattern) const {
-            return find_sublist(tokens, pattern, start);
+            return find_sublist(tokens, pattern, std::next(tokens.begin(), start));
         }
         
         ContainerT tokens;
-        iterator start;
+        std::size_t start;
     };
     
     template <class ContainerT>
@@ -166,18 +219,26 @@ namespace ppstep {
     
     template <class TokenT, class ContainerT>
     struct client {
-        client(server_state<ContainerT>& state, std::string prefix) : state(&state), cli(client_cli<TokenT, ContainerT>(*this, std::move(prefix))), mode(stepping_mode::FREE) {}
+        client(server_state<ContainerT>& state, std::string prefix) : state(&state), cli(client_cli<TokenT, ContainerT>(*this, std::move(prefix))), mode(stepping_mode::FREE), target_depth(0), current_type(preprocessing_event_type::LEXED), current_level(0), lexed_watch_state(token_automaton::root), lexed_watch_generation(0), collapse_threshold(0), recording(nullptr) {}
         
         client(server_state<ContainerT>& state) : client(state, "") {}
 
+        // Everything the client stores is kept as compact tokens; Wave tokens are converted on the way in.
+        using sequence_type = compact_sequence;
+
         template <class ContextT>
-        void on_lexed(ContextT& ctx, TokenT const& token) {
+        void on_lexed(ContextT& ctx, TokenT const& lexed) {
+            flush_pending(ctx);
+
+            auto token = compact_token(lexed);
+            if (!IS_CATEGORY(lexed, boost::wave::EOLTokenType)) watch_lexed(token);
+
             if (token_stack.empty()) {
-                auto last_tokens = token_history.empty() ? ContainerT() : newest_history()->tokens;
+                auto last_tokens = token_history.empty() ? sequence_type() : newest_history()->tokens;
                 last_tokens.push_back(token);
 
                 lexed_tokens.push_back(token);
-                token_history.push_back(historical_event<ContainerT>(last_tokens, events::lexed<ContainerT>()));
+                token_history.push_back(historical_event<sequence_type>(std::move(last_tokens), events::lexed<sequence_type>()));
 
                 handle_prompt(ctx, token, preprocessing_event_type::LEXED);
 
@@ -186,8 +247,7 @@ namespace ppstep {
 
                 lex_buffer.push_back(token);
                 if (std::equal(std::next(std::begin(last_tokens), lexed_tokens.size()), std::end(last_tokens),
-                               std::begin(lex_buffer), std::end(lex_buffer),
-                               [](auto const& a, auto const& b) { return a.get_value() == b.get_value(); })) {
+                               std::begin(lex_buffer), std::end(lex_buffer))) {
                     lexed_tokens.insert(std::end(lexed_tokens), std::begin(lex_buffer), std::end(lex_buffer));
                     lex_buffer.clear();
                     reset_token_stack();
@@ -196,140 +256,215 @@ namespace ppstep {
         }
 
         template <class ContextT>
-        void on_expand_function(ContextT& ctx, TokenT const& call, std::vector<ContainerT> const& arguments, ContainerT call_tokens) {
-            if (token_stack.empty()) {
-                push(std::move(call_tokens), events::call<ContainerT>(call_tokens, lexed_tokens.size() + 0, lexed_tokens.size() + call_tokens.size()));
-            } else {
-                auto lookup = find_match_indices(token_stack.back(), call_tokens);
-                if (lookup) {
-                    auto [start, end] = *lookup;
-                    token_history.push_back(historical_event<ContainerT>(
-                        prepend_lexed(token_stack.back().tokens),
-                        events::call<ContainerT>(call_tokens, lexed_tokens.size() + start, lexed_tokens.size() + end)));
-                } else {
-                    reset_token_stack();
-                    push(std::move(call_tokens), events::call<ContainerT>(call_tokens, lexed_tokens.size() + 0, lexed_tokens.size() + call_tokens.size()));
-                }
-            }
-            
-            handle_prompt(ctx, call, preprocessing_event_type::CALL);
+        void on_expand_function(ContextT& ctx, TokenT const& macro, std::vector<ContainerT> const& arguments, ContainerT const& call) {
+            if (recording) recording->called(macro, call);
+            on_call(ctx, compact_token(macro), compact(call));
         }
 
         template <class ContextT>
         void on_expand_object(ContextT& ctx, TokenT const& call) {
-            auto call_tokens = ContainerT{call};
-            
-            if (token_stack.empty()) {
-                push(std::move(call_tokens), events::call<ContainerT>(call_tokens, lexed_tokens.size() + 0, lexed_tokens.size() + call_tokens.size()));
-            } else {
-                auto lookup = find_match_indices(token_stack.back(), call_tokens);
-                if (lookup) {
-                    auto [start, end] = *lookup;
-                    token_history.push_back(historical_event<ContainerT>(
-                        prepend_lexed(token_stack.back().tokens),
-                        events::call<ContainerT>(call_tokens, lexed_tokens.size() + start, lexed_tokens.size() + end)));
-                } else {
-                    reset_token_stack();
-                    push(std::move(call_tokens), events::call<ContainerT>(call_tokens, lexed_tokens.size() + 0, lexed_tokens.size() + call_tokens.size()));
-                }
-            }
-
-            handle_prompt(ctx, call, preprocessing_event_type::CALL);
+            if (recording) recording->called(call);
+            on_call(ctx, compact_token(call), sequence_type{compact_token(call)});
         }
 
         template <class ContextT>
-        void on_expanded(ContextT& ctx, ContainerT const& initial, ContainerT const& result) {
-            try {
-                auto const& [tokens, start, end] = match(initial);
-
-                ContainerT new_tokens;
-                std::size_t new_start, new_end;
-                splice_between(*tokens, result, start, end, new_tokens, new_start, new_end);
-
-                push(std::move(new_tokens),
-                     std::next(new_tokens.begin(), new_start),
-                     events::expanded<ContainerT>(initial, lexed_tokens.size() + new_start, lexed_tokens.size() + new_end));
-
-            } catch (std::logic_error const&) {
-                push(ContainerT(result), events::expanded<ContainerT>(initial, lexed_tokens.size() + 0, lexed_tokens.size() + result.size()));
+        void on_expanded(ContextT& ctx, ContainerT const& initial_call, ContainerT const& expanded) {
+            PPSTEP_TIME_HOOK(on_expanded);
+            if (recording) recording->expanded_to(initial_call, expanded);
+
+            auto initial = compact(initial_call);
+            auto result = compact(expanded);
+            auto level = event_level(preprocessing_event_type::EXPANDED);
+
+            if (pending && !pending->expanded && result.size() <= collapse_threshold
+                    && expanded_breakpoints.find(initial.front().value) == expanded_breakpoints.end()) {
+                pending->expanded = std::move(result);
+                pending->expanded_level = level;
+                return;
             }
+            flush_pending(ctx);
 
-            handle_prompt(ctx, *(initial.begin()), preprocessing_event_type::EXPANDED);
+            record_expanded(ctx, initial, result, level);
         }
 
         template <class ContextT>
-        void on_rescanned(ContextT& ctx, ContainerT const& cause, ContainerT const& initial, ContainerT const& result) {
-            if (initial.empty()) return;
+        void on_rescanned(ContextT& ctx, ContainerT const& cause_call, ContainerT const& expanded, ContainerT const& rescanned) {
+            PPSTEP_TIME_HOOK(on_rescanned);
+            if (recording) recording->rescanned_to(cause_call, expanded, rescanned);
+
+            if (pending && pending->expanded) {
+                auto trivial = std::move(*pending);
+                pending.reset();
+                record_collapsed(ctx, trivial, compact(rescanned), event_level(preprocessing_event_type::RESCANNED));
+                return;
+            }
+            flush_pending(ctx);
+
+            if (expanded.empty()) return;
+
+            auto cause = compact(cause_call);
+            auto initial = compact(expanded);
+            auto result = compact(rescanned);
+            watch(result);
 
             try {
                 auto const& [tokens, start, end] = match(initial);
 
-                ContainerT new_tokens;
+                sequence_type new_tokens;
                 std::size_t new_start, new_end;
                 splice_between(*tokens, result, start, end, new_tokens, new_start, new_end);
                 
                 push(std::move(new_tokens),
-                     std::next(new_tokens.begin(), new_start),
-                     events::rescanned<ContainerT>(cause, initial, lexed_tokens.size() + new_start, lexed_tokens.size() + new_end));
+                     new_start,
+                     events::rescanned<sequence_type>(cause, initial, lexed_tokens.size() + new_start, lexed_tokens.size() + new_end));
 
             } catch (std::logic_error const&) {
-                push(ContainerT(result), events::rescanned<ContainerT>(cause, initial, lexed_tokens.size() + 0, lexed_tokens.size() + result.size()));
+                push(sequence_type(result), events::rescanned<sequence_type>(cause, initial, lexed_tokens.size() + 0, lexed_tokens.size() + result.size()));
             }
 
-            handle_prompt(ctx, *(initial.begin()), preprocessing_event_type::RESCANNED);
+            handle_prompt(ctx, initial.front(), preprocessing_event_type::RESCANNED);
         }
         
+        void on_scope_entered() {
+            // tokens recorded before leaving the previous scope no longer line up with the token stream
+            pending.reset();
+            lexed_tokens.clear();
+            lex_buffer.clear();
+            reset_token_stack();
+        }
+
+        template <typename ContextT>
+        void on_limit(ContextT& ctx, std::string const& message) {
+            flush_pending(ctx);
+            cli.report_limit(message);
+            cli.interrupt(ctx, "limit");
+        }
+
+        template <typename ContextT>
+        void on_interrupt(ContextT& ctx) {
+            cli.interrupt(ctx, "interrupt");
+        }
+
         template <typename ContextT, typename ExceptionT>
         void on_exception(ContextT& ctx, ExceptionT const& e) {
-            std::cout << e.what() << ": " << e.description() << std::endl;
+            flush_pending(ctx);
+            cli.report_exception(e);
             cli.prompt(ctx, "exception");
         }
 
         template <class ContextT>
         void on_complete(ContextT& ctx) {
+            flush_pending(ctx);
             cli.prompt(ctx, "complete");
         }
         
         template <class ContextT>
         void on_start(ContextT& ctx) {
-            std::cout << "Preprocessing " << ctx.get_main_pos() << '.' << std::endl;
+            cli.report_start(ctx);
             cli.prompt(ctx, "started", false);
         }
 
-        void add_breakpoint(typename TokenT::string_type const& macro, preprocessing_event_type cond) {
+        void add_breakpoint(std::string const& macro, preprocessing_event_type cond) {
+            auto id = token_table::local().intern(macro);
             switch (cond) {
                 case preprocessing_event_type::CALL: {
-                    expansion_breakpoints.insert(macro);
+                    expansion_breakpoints.insert(id);
                     break;
                 }
                 case preprocessing_event_type::EXPANDED: {
-                    expanded_breakpoints.insert(macro);
+                    expanded_breakpoints.insert(id);
                     break;
                 }
             }
         }
 
-        void remove_breakpoint(typename TokenT::string_type const& macro, preprocessing_event_type cond) {
+        void remove_breakpoint(std::string const& macro, preprocessing_event_type cond) {
+            auto id = token_table::local().intern(macro);
             switch (cond) {
                 case preprocessing_event_type::CALL: {
-                    expansion_breakpoints.erase(macro);
+                    expansion_breakpoints.erase(id);
                     break;
                 }
                 case preprocessing_event_type::EXPANDED: {
-                    expanded_breakpoints.erase(macro);
+                    expanded_breakpoints.erase(id);
                     break;
                 }
             }
         }
         
+        std::size_t add_watchpoint(token_automaton::pattern_type pattern) {
+            return watches.add(std::move(pattern));
+        }
+
+        bool remove_watchpoint(std::size_t id) {
+            return watches.remove(id);
+        }
+
+        std::map<std::size_t, token_automaton::pattern_type> const& get_watchpoints() const {
+            return watches.get_patterns();
+        }
+
         server_state<ContainerT> const& get_state() {
             return *state;
         }
 
+        expansion_limits& get_limits() {
+            return state->watchdog.limits;
+        }
+
+        void pause_progress() {
+            state->progress.clear();
+        }
+
+        void resume_watchdog() {
+            state->progress.resume();
+            state->watchdog.resume();
+        }
+
+        void set_trace_scope(std::set<typename TokenT::string_type> macros) {
+            state->trace_scope = std::move(macros);
+        }
+
+        void set_protocol(protocol_channel* channel) {
+            cli.set_channel(channel);
+        }
+
         void set_mode(stepping_mode m) {
             mode = m;
         }
 
+        // Runs until the next event at the current expansion depth or shallower, so that the whole
+        // call/expand/rescan cycle of a nested macro counts as a single step.
+        void step_over() {
+            target_depth = current_level;
+            mode = stepping_mode::STEP_OVER;
+        }
+
+        // Runs until the innermost open expansion has been rescanned. Returns false if there is none.
+        bool step_out() {
+            auto frame = current_frame();
+            if (frame == 0) return false;
+
+            target_depth = frame;
+            mode = stepping_mode::STEP_OUT;
+            return true;
+        }
+
+        // Expansions that call no other macro and produce at most this many tokens are reported as a single
+        // collapsed event instead of a call, an expansion and a rescan. Zero turns collapsing off.
+        void set_collapse_threshold(std::size_t tokens) {
+            collapse_threshold = tokens;
+        }
+
+        std::size_t get_collapse_threshold() const {
+            return collapse_threshold;
+        }
+
+        // Keeps a copy of every expansion event from now on, so that the session can be replayed.
+        void record_into(expansion_recording<TokenT, ContainerT>* r) {
+            recording = r;
+        }
+
         auto newest_history() {
             return token_history.rbegin();
         }
@@ -339,32 +474,137 @@ namespace ppstep {
         }
 
     private:
-        using container_iterator = typename ContainerT::const_iterator;
+        using container_iterator = typename sequence_type::const_iterator;
         
-        using range_container = std::tuple<ContainerT const*, container_iterator, container_iterator>;
+        using range_container = std::tuple<sequence_type const*, container_iterator, container_iterator>;
 
-        ContainerT prepend_lexed(ContainerT const& tokens) {
-            auto acc = ContainerT(std::begin(lexed_tokens), std::end(lexed_tokens));
+        sequence_type prepend_lexed(sequence_type const& tokens) {
+            auto acc = sequence_type();
+            acc.reserve(lexed_tokens.size() + tokens.size());
+            acc.insert(std::end(acc), std::begin(lexed_tokens), std::end(lexed_tokens));
             acc.insert(std::end(acc), std::begin(tokens), std::end(tokens));
             return acc;
         }
 
-        void push(ContainerT&& tokens, preprocessing_event<ContainerT>&& event) {
-            push(std::move(tokens), std::begin(tokens), std::move(event));
+        void push(sequence_type&& tokens, preprocessing_event<sequence_type>&& event) {
+            push(std::move(tokens), 0, std::move(event));
         }
 
-        void push(ContainerT&& tokens, container_iterator&& head, preprocessing_event<ContainerT>&& event) {
-            auto historical_tokens = prepend_lexed(tokens);
-            token_history.push_back(historical_event<ContainerT>(historical_tokens, std::move(event)));
+        void push(sequence_type&& tokens, std::size_t head, preprocessing_event<sequence_type>&& event) {
+            token_history.push_back(historical_event<sequence_type>(prepend_lexed(tokens), std::move(event)));
+            token_stack.emplace_back(std::move(tokens), head);
+        }
+
+        // A call held back until it is known whether its expansion is trivial.
+        struct pending_expansion {
+            compact_token macro;
+            sequence_type call;
+            std::size_t call_level;
+            std::optional<sequence_type> expanded;
+            std::size_t expanded_level;
+        };
+
+        template <class ContextT>
+        void on_call(ContextT& ctx, compact_token const& macro, sequence_type&& call_tokens) {
+            auto level = event_level(preprocessing_event_type::CALL);
+
+            // a call inside a held-back expansion means that one was not trivial after all
+            flush_pending(ctx);
+
+            if (collapse_threshold && expansion_breakpoints.find(macro.value) == expansion_breakpoints.end()) {
+                pending.emplace(pending_expansion{macro, std::move(call_tokens), level, std::nullopt, 0});
+                return;
+            }
+
+            record_call(ctx, macro, std::move(call_tokens), level);
+        }
+
+        template <class ContextT>
+        void flush_pending(ContextT& ctx) {
+            if (!pending) return;
 
-            if (head != tokens.end()) {
-                token_stack.emplace_back(std::move(tokens), std::move(head));
+            auto held = std::move(*pending);
+            pending.reset();
+
+            auto initial = held.call;
+            record_call(ctx, held.macro, std::move(held.call), held.call_level);
+            if (held.expanded) record_expanded(ctx, initial, *held.expanded, held.expanded_level);
+        }
+
+        template <class ContextT>
+        void record_call(ContextT& ctx, compact_token const& macro, sequence_type&& call_tokens, std::size_t level) {
+            if (token_stack.empty()) {
+                push(std::move(call_tokens), events::call<sequence_type>(call_tokens, lexed_tokens.size() + 0, lexed_tokens.size() + call_tokens.size()));
             } else {
-                token_stack.emplace_back(std::move(tokens));
+                auto lookup = find_match_indices(token_stack.back(), call_tokens);
+                if (lookup) {
+                    auto [start, end] = *lookup;
+                    token_history.push_back(historical_event<sequence_type>(
+                        prepend_lexed(token_stack.back().tokens),
+                        events::call<sequence_type>(call_tokens, lexed_tokens.size() + start, lexed_tokens.size() + end)));
+                } else {
+                    reset_token_stack();
+                    push(std::move(call_tokens), events::call<sequence_type>(call_tokens, lexed_tokens.size() + 0, lexed_tokens.size() + call_tokens.size()));
+                }
             }
+
+            handle_prompt(ctx, macro, preprocessing_event_type::CALL, level);
+        }
+
+        template <class ContextT>
+        void record_expanded(ContextT& ctx, sequence_type const& initial, sequence_type const& result, std::size_t level) {
+            watch(result);
+
+            try {
+                auto const& [tokens, start, end] = match(initial);
+
+                sequence_type new_tokens;
+                std::size_t new_start, new_end;
+                splice_between(*tokens, result, start, end, new_tokens, new_start, new_end);
+
+                push(std::move(new_tokens),
+                     new_start,
+                     events::expanded<sequence_type>(initial, lexed_tokens.size() + new_start, lexed_tokens.size() + new_end));
+
+            } catch (std::logic_error const&) {
+                push(sequence_type(result), events::expanded<sequence_type>(initial, lexed_tokens.size() + 0, lexed_tokens.size() + result.size()));
+            }
+
+            handle_prompt(ctx, initial.front(), preprocessing_event_type::EXPANDED, level);
         }
 
-        range_container match(ContainerT const& pattern) {
+        // Leaves the token stack as the call, expansion and rescan would have, with a single history entry.
+        template <class ContextT>
+        void record_collapsed(ContextT& ctx, pending_expansion const& held, sequence_type const& result, std::size_t level) {
+            watch(*held.expanded);
+            watch(result);
+
+            if (token_stack.empty() || !find_match_indices(token_stack.back(), held.call)) {
+                reset_token_stack();
+                token_stack.emplace_back(sequence_type(held.call), 0);
+            }
+
+            try {
+                auto const& [tokens, start, end] = match(held.call);
+
+                sequence_type new_tokens;
+                std::size_t new_start, new_end;
+                splice_between(*tokens, result, start, end, new_tokens, new_start, new_end);
+
+                push(std::move(new_tokens),
+                     new_start,
+                     events::collapsed<sequence_type>(held.call, lexed_tokens.size() + new_start, lexed_tokens.size() + new_end));
+
+            } catch (std::logic_error const&) {
+                push(sequence_type(result), events::collapsed<sequence_type>(held.call, lexed_tokens.size() + 0, lexed_tokens.size() + result.size()));
+            }
+
+            handle_prompt(ctx, held.macro, preprocessing_event_type::COLLAPSED, level);
+        }
+
+        range_container match(sequence_type const& pattern) {
+            PPSTEP_TIME_HOOK(match);
+
             while (!token_stack.empty()) {
                 auto const& top = token_stack.back();
 
@@ -384,7 +624,7 @@ namespace ppstep {
             throw std::logic_error("could not find pattern \"" + ss.str() + "\" in token stack");
         }
         
-        std::optional<std::pair<std::size_t, std::size_t>> find_match_indices(offset_container<ContainerT> const& oc, ContainerT const& pattern) {
+        std::optional<std::pair<std::size_t, std::size_t>> find_match_indices(offset_container<sequence_type> const& oc, sequence_type const& pattern) {
             auto sublist = oc.find_pattern(pattern);
             if (sublist) {
                 auto [start, end] = *sublist;
@@ -397,8 +637,10 @@ namespace ppstep {
             }
         }
 
-        void splice_between(ContainerT const& tokens, ContainerT const& result, container_iterator start, container_iterator end,
-                                                       ContainerT& new_tokens, std::size_t& new_start, std::size_t& new_end) {
+        void splice_between(sequence_type const& tokens, sequence_type const& result, container_iterator start, container_iterator end,
+                                                       sequence_type& new_tokens, std::size_t& new_start, std::size_t& new_end) {
+            PPSTEP_TIME_HOOK(splice_between);
+
             new_tokens.insert(new_tokens.end(), tokens.begin(), start);
             new_start = new_tokens.size();
 
@@ -417,30 +659,117 @@ namespace ppstep {
                 case preprocessing_event_type::CALL: return "called";
                 case preprocessing_event_type::EXPANDED: return "expanded";
                 case preprocessing_event_type::RESCANNED: return "rescanned";
+                case preprocessing_event_type::COLLAPSED: return "collapsed";
                 case preprocessing_event_type::LEXED: return "lexed";
                 default: return "";
             }
         }
 
+        // Expansion and rescan results are matched on their own; lexed output is matched as one stream.
+        void watch(sequence_type const& tokens) {
+            if (watches.empty() || watch_hit) return;
+            watch_hit = watches.scan(tokens);
+        }
+
+        void watch_lexed(compact_token const& token) {
+            if (watches.empty()) return;
+
+            auto generation = watches.generation();
+            if (generation != lexed_watch_generation) {
+                lexed_watch_state = token_automaton::root;
+                lexed_watch_generation = generation;
+            }
+
+            lexed_watch_state = watches.step(lexed_watch_state, token.value);
+            if (!watch_hit) watch_hit = watches.match(lexed_watch_state);
+        }
+
+        // Number of expansions enclosing the macro an event is about. The server updates its stacks after
+        // notifying the client, so a call is not counted yet while expanded and rescanned macros still are.
+        std::size_t event_level(preprocessing_event_type type) const {
+            auto depth = state->expanding.size() + state->rescanning.size();
+            switch (type) {
+                case preprocessing_event_type::CALL: return depth;
+                case preprocessing_event_type::EXPANDED:
+                case preprocessing_event_type::RESCANNED: return depth ? depth - 1 : 0;
+                default: return 0;
+            }
+        }
+
+        // Depth of the innermost expansion still open at the current event.
+        std::size_t current_frame() const {
+            switch (current_type) {
+                case preprocessing_event_type::CALL:
+                case preprocessing_event_type::EXPANDED: return current_level + 1;
+                case preprocessing_event_type::RESCANNED:
+                case preprocessing_event_type::COLLAPSED: return current_level;
+                default: return 0;
+            }
+        }
+
         template <class ContextT>
-        void handle_prompt(ContextT& ctx, TokenT const& token, preprocessing_event_type type) {
+        void handle_prompt(ContextT& ctx, compact_token const& token, preprocessing_event_type type) {
+            handle_prompt(ctx, token, type, event_level(type));
+        }
+
+        // Events that were held back are reported late, with the level they had when they happened.
+        template <class ContextT>
+        void handle_prompt(ContextT& ctx, compact_token const& token, preprocessing_event_type type, std::size_t level) {
+            cli.stream_event(ctx);
+
             bool do_prompt = false;
 
+            if (watch_hit) {
+                auto id = *watch_hit;
+                watch_hit.reset();
+
+                current_type = type;
+                current_level = level;
+                cli.report_watchpoint(id, watches.get_patterns().at(id));
+                cli.interrupt(ctx, get_preprocessing_event_type_name(type));
+                return;
+            }
+
+            if (interrupt_requested()) {
+                clear_interrupt();
+
+                current_type = type;
+                current_level = level;
+                cli.interrupt(ctx, "interrupt");
+                return;
+            }
+
             switch (mode) {
                 case stepping_mode::FREE: {
                     do_prompt = true;
                     break;
                 }
-                case stepping_mode::UNTIL_BREAK: {
+                case stepping_mode::STEP_OVER: {
+                    do_prompt = level <= target_depth;
+                    break;
+                }
+                case stepping_mode::STEP_OUT: {
+                    do_prompt = (type == preprocessing_event_type::RESCANNED || type == preprocessing_event_type::COLLAPSED)
+                            && level + 1 <= target_depth;
+                    break;
+                }
+                default:
+                    break;
+            }
+
+            switch (mode) {
+                case stepping_mode::UNTIL_BREAK:
+                case stepping_mode::STEP_OVER:
+                case stepping_mode::STEP_OUT: {
                     switch (type) {
                         case preprocessing_event_type::CALL: {
-                            if (expansion_breakpoints.find(token.get_value()) != expansion_breakpoints.end()) {
+                            if (expansion_breakpoints.find(token.value) != expansion_breakpoints.end()) {
                                 do_prompt = true;
                             }
                             break;
                         }
                         case preprocessing_event_type::EXPANDED: {
-                            if (expanded_breakpoints.find(token.get_value()) != expanded_breakpoints.end()) {
+                            if (expanded_breakpoints.find(token.value) != expanded_breakpoints.end()) {
                                 do_prompt = true;
                             }
                             break;
@@ -448,23 +777,41 @@ namespace ppstep {
                     }
                     break;
                 }
+                default:
+                    break;
             }
 
             if (do_prompt) {
+                current_type = type;
+                current_level = level;
                 cli.prompt(ctx, get_preprocessing_event_type_name(type));
             }
         }
 
         server_state<ContainerT>* state;
         client_cli<TokenT, ContainerT> cli;
-        std::set<typename TokenT::string_type> expansion_breakpoints;
-        std::set<typename TokenT::string_type> expanded_breakpoints;
+        std::unordered_set<std::uint32_t> expansion_breakpoints;
+        std::unordered_set<std::uint32_t> expanded_breakpoints;
         stepping_mode mode;
+        std::size_t target_depth;
+
+        preprocessing_event_type current_type;
+        std::size_t current_level;
+
+        token_automaton watches;
+        token_automaton::state_type lexed_watch_state;
+        std::size_t lexed_watch_generation;
+        std::optional<std::size_t> watch_hit;
+
+        std::size_t collapse_threshold;
+        std::optional<pending_expansion> pending;
+
+        expansion_recording<TokenT, ContainerT>* recording;
 
-        std::list<offset_container<ContainerT>> token_stack;
-        std::vector<historical_event<ContainerT>> token_history;
-        std::vector<TokenT> lexed_tokens;
-        std::vector<TokenT> lex_buffer;
+        std::list<offset_container<sequence_type>> token_stack;
+        std::vector<historical_event<sequence_type>> token_history;
+        sequence_type lexed_tokens;
+        sequence_type lex_buffer;
     };
 }
 
@@ -2,6 +2,7 @@
 #define PPSTEP_CLIENT_FWD_HPP
 
 #include <exception>
+#include <stdexcept>
 
 namespace ppstep {
     template <class TokenT, class ContainerT>
@@ -12,18 +13,25 @@ namespace ppstep {
         CALL = 1 << 0,
         EXPANDED = 1 << 1,
         RESCANNED = 1 << 2,
-        LEXED = 1 << 3
+        LEXED = 1 << 3,
+        COLLAPSED = 1 << 4
     };
 
     enum class stepping_mode {
         INVALID = 0,
         FREE = 1 << 0,
-        UNTIL_BREAK = 1 << 1
+        UNTIL_BREAK = 1 << 1,
+        STEP_OVER = 1 << 2,
+        STEP_OUT = 1 << 3
     };
 
     struct session_terminate : std::exception {
         using std::exception::exception;
     };
+
+    struct limit_exceeded : std::runtime_error {
+        using std::runtime_error::runtime_error;
+    };
 }
 
 #endif // PPSTEP_CLIENT_FWD_HPP
\ No newline at end of file
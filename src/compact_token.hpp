@@ -0,0 +1,111 @@
+#ifndef PPSTEP_COMPACT_TOKEN_HPP
+#define PPSTEP_COMPACT_TOKEN_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+
+namespace ppstep {
+    struct packed_position {
+        std::uint32_t file;
+        std::uint32_t line;
+        std::uint32_t column;
+
+        bool operator==(packed_position const& rhs) const {
+            return file == rhs.file && line == rhs.line && column == rhs.column;
+        }
+    };
+
+    // Interns token spellings and file names for the client, so that stored tokens hold ids instead of strings
+    // and comparing tokens compares integers. Tables are per thread, as each preprocessing context runs on one.
+    struct token_table {
+        static token_table& local() {
+            thread_local token_table table;
+            return table;
+        }
+
+        std::uint32_t intern(std::string_view str) {
+            auto it = ids.find(str);
+            if (it != ids.end()) return it->second;
+
+            auto id = static_cast<std::uint32_t>(strings.size());
+            auto const& stored = strings.emplace_back(str);
+            ids.emplace(std::string_view(stored), id);
+            return id;
+        }
+
+        // Files change rarely from one token to the next, so the last one looked up is remembered.
+        template <class PositionT>
+        packed_position pack(PositionT const& pos) {
+            auto const& file = pos.get_file();
+            if (last_file != std::string_view(file.c_str(), file.size())) {
+                last_file_id = intern(std::string_view(file.c_str(), file.size()));
+                last_file = strings[last_file_id];
+            }
+            return packed_position{last_file_id, static_cast<std::uint32_t>(pos.get_line()), static_cast<std::uint32_t>(pos.get_column())};
+        }
+
+        std::string const& string(std::uint32_t id) const {
+            return strings[id];
+        }
+
+    private:
+        token_table() : last_file_id(0) {}
+
+        std::deque<std::string> strings; // stable addresses, viewed by the keys of ids
+        std::unordered_map<std::string_view, std::uint32_t> ids;
+
+        std::string_view last_file;
+        std::uint32_t last_file_id;
+    };
+
+    // Client-side token: an interned spelling plus a packed position. Tokens compare equal when their
+    // spellings do, which is how the client has always matched tokens.
+    struct compact_token {
+        compact_token() : value(0), position{0, 0, 0} {}
+
+        template <class TokenT>
+        explicit compact_token(TokenT const& token) {
+            auto& table = token_table::local();
+            auto const& str = token.get_value();
+            value = table.intern(std::string_view(str.c_str(), str.size()));
+            position = table.pack(token.get_position());
+        }
+
+        std::string const& get_value() const {
+            return token_table::local().string(value);
+        }
+
+        packed_position const& get_position() const {
+            return position;
+        }
+
+        bool operator==(compact_token const& rhs) const {
+            return value == rhs.value;
+        }
+
+        bool operator!=(compact_token const& rhs) const {
+            return value != rhs.value;
+        }
+
+        std::uint32_t value;
+        packed_position position;
+    };
+
+    using compact_sequence = std::vector<compact_token>;
+
+    template <class ContainerT>
+    compact_sequence compact(ContainerT const& tokens) {
+        auto acc = compact_sequence();
+        acc.reserve(tokens.size());
+        for (auto const& token : tokens) {
+            acc.emplace_back(token);
+        }
+        return acc;
+    }
+}
+
+#endif // PPSTEP_COMPACT_TOKEN_HPP
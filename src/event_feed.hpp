@@ -0,0 +1,265 @@
+#ifndef PPSTEP_EVENT_FEED_HPP
+#define PPSTEP_EVENT_FEED_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <optional>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace ppstep {
+    // A session's events, published into a named shared memory segment for other processes to watch. The
+    // segment is a ring of fixed-size slots with a single writer that never waits for readers. Each slot carries
+    // the sequence number of the event in it, which readers check before and after copying it out, so a slot
+    // that was overwritten under a slow reader is dropped rather than misread.
+    namespace feed {
+        static constexpr std::uint64_t magic = 0x646565667070ull; // "ppfeed"
+        static constexpr std::uint32_t version = 1;
+        static constexpr std::size_t capacity = 1 << 14;
+        static constexpr std::size_t name_size = 62;
+        static constexpr std::size_t text_size = 176;
+
+        enum class event_kind : std::uint16_t {
+            called = 1,
+            expanded,
+            rescanned,
+            stopped, // text is what stopped the session; the backtrace follows as frames
+            frame,   // a call in the backtrace; depth is its index, innermost first
+            rescan_frame, // the same, for a call whose expansion is being rescanned
+        };
+
+        struct slot {
+            std::atomic<std::uint64_t> sequence; // event number + 1 once written, 0 while being written
+            event_kind kind;
+            std::uint16_t name_length;
+            std::uint16_t text_length;
+            std::uint16_t truncated;
+            std::uint32_t depth;
+            char name[name_size];
+            char text[text_size];
+        };
+
+        struct header {
+            std::uint64_t magic;
+            std::uint32_t version;
+            std::uint32_t capacity;
+            std::int64_t pid;
+            std::atomic<std::uint64_t> published;
+            std::atomic<std::uint32_t> closed;
+        };
+
+        static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "the feed needs lock-free 64-bit atomics");
+
+        inline std::size_t segment_size() {
+            return sizeof(header) + capacity * sizeof(slot);
+        }
+
+        // An event as a reader sees it.
+        struct event {
+            std::uint64_t sequence;
+            event_kind kind;
+            std::uint32_t depth;
+            bool truncated;
+            std::string name;
+            std::string text;
+        };
+
+        inline char const* kind_name(event_kind kind) {
+            switch (kind) {
+                case event_kind::called: return "called";
+                case event_kind::expanded: return "expanded";
+                case event_kind::rescanned: return "rescanned";
+                case event_kind::stopped: return "stopped";
+                case event_kind::frame: return "frame";
+                case event_kind::rescan_frame: return "rescan frame";
+            }
+            return "unknown";
+        }
+    }
+
+    struct event_publisher {
+        event_publisher(std::string name) : name(std::move(name)), next(0) {
+            namespace ip = boost::interprocess;
+
+            ip::shared_memory_object::remove(this->name.c_str());
+            auto shm = ip::shared_memory_object(ip::create_only, this->name.c_str(), ip::read_write);
+            shm.truncate(feed::segment_size());
+            region = ip::mapped_region(shm, ip::read_write);
+
+            auto* h = new (region.get_address()) feed::header();
+            h->magic = feed::magic;
+            h->version = feed::version;
+            h->capacity = feed::capacity;
+            h->pid = ::getpid();
+            h->published.store(0, std::memory_order_relaxed);
+            h->closed.store(0, std::memory_order_relaxed);
+
+            slots = reinterpret_cast<feed::slot*>(h + 1);
+            for (std::size_t i = 0; i != feed::capacity; ++i) {
+                new (&slots[i]) feed::slot();
+                slots[i].sequence.store(0, std::memory_order_relaxed);
+            }
+            header = h;
+        }
+
+        ~event_publisher() {
+            header->closed.store(1, std::memory_order_release);
+            boost::interprocess::shared_memory_object::remove(name.c_str());
+        }
+
+        event_publisher(event_publisher const&) = delete;
+        event_publisher& operator=(event_publisher const&) = delete;
+
+        std::string const& segment_name() const {
+            return name;
+        }
+
+        template <class TokenT, class ContainerT>
+        void called(std::size_t depth, TokenT const& macro, ContainerT const& call) {
+            publish(feed::event_kind::called, depth, macro.get_value().c_str(), call);
+        }
+
+        template <class TokenT, class ContainerT>
+        void expanded(std::size_t depth, TokenT const& macro, ContainerT const& result) {
+            publish(feed::event_kind::expanded, depth, macro.get_value().c_str(), result);
+        }
+
+        template <class TokenT, class ContainerT>
+        void rescanned(std::size_t depth, TokenT const& macro, ContainerT const& result) {
+            publish(feed::event_kind::rescanned, depth, macro.get_value().c_str(), result);
+        }
+
+        // A snapshot of the backtrace, for viewers that attach while the session is at the prompt.
+        template <class StateT>
+        void stopped(std::string const& trigger, StateT const& state) {
+            auto depth = state.expanding.size() + state.rescanning.size();
+            begin(feed::event_kind::stopped, depth, "");
+            append(trigger);
+            end();
+
+            std::size_t idx = 0;
+            for (auto it = state.expanding.rbegin(); it != state.expanding.rend(); ++it, ++idx) {
+                publish(feed::event_kind::frame, idx, it->front().get_value().c_str(), *it);
+            }
+            for (auto it = state.rescanning.rbegin(); it != state.rescanning.rend(); ++it, ++idx) {
+                publish(feed::event_kind::rescan_frame, idx, it->first.front().get_value().c_str(), it->first);
+            }
+        }
+
+    private:
+        template <class ContainerT>
+        void publish(feed::event_kind kind, std::size_t depth, char const* macro, ContainerT const& tokens) {
+            begin(kind, depth, macro);
+            for (auto const& token : tokens) {
+                if (current->text_length) append(" ");
+                append(token.get_value().c_str());
+                if (current->truncated) break;
+            }
+            end();
+        }
+
+        void begin(feed::event_kind kind, std::size_t depth, char const* macro) {
+            current = &slots[next % feed::capacity];
+            current->sequence.store(0, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            current->kind = kind;
+            current->depth = static_cast<std::uint32_t>(depth);
+            current->truncated = 0;
+            current->text_length = 0;
+            auto name_length = std::min(std::strlen(macro), feed::name_size);
+            std::memcpy(current->name, macro, name_length);
+            current->name_length = static_cast<std::uint16_t>(name_length);
+        }
+
+        void append(std::string_view text) {
+            auto room = feed::text_size - current->text_length;
+            if (text.size() > room) {
+                text = text.substr(0, room);
+                current->truncated = 1;
+            }
+            std::memcpy(current->text + current->text_length, text.data(), text.size());
+            current->text_length += static_cast<std::uint16_t>(text.size());
+        }
+
+        void end() {
+            ++next;
+            current->sequence.store(next, std::memory_order_release);
+            header->published.store(next, std::memory_order_release);
+        }
+
+        std::string name;
+        boost::interprocess::mapped_region region;
+        feed::header* header;
+        feed::slot* slots;
+        feed::slot* current;
+        std::uint64_t next;
+    };
+
+    struct event_subscriber {
+        // Throws boost::interprocess::interprocess_exception if there is no such segment.
+        event_subscriber(std::string const& name) {
+            namespace ip = boost::interprocess;
+
+            auto shm = ip::shared_memory_object(ip::open_only, name.c_str(), ip::read_only);
+            region = ip::mapped_region(shm, ip::read_only);
+            header = static_cast<feed::header const*>(region.get_address());
+            slots = reinterpret_cast<feed::slot const*>(header + 1);
+        }
+
+        bool compatible() const {
+            return region.get_size() >= feed::segment_size() && header->magic == feed::magic
+                    && header->version == feed::version && header->capacity == feed::capacity;
+        }
+
+        std::int64_t pid() const {
+            return header->pid;
+        }
+
+        bool closed() const {
+            return header->closed.load(std::memory_order_acquire) != 0;
+        }
+
+        std::uint64_t published() const {
+            return header->published.load(std::memory_order_acquire);
+        }
+
+        // The oldest event that has not been overwritten yet.
+        std::uint64_t oldest() const {
+            auto newest = published();
+            return newest > feed::capacity ? newest - feed::capacity : 0;
+        }
+
+        // Event n, unless the writer has already lapped it.
+        std::optional<feed::event> read(std::uint64_t n) const {
+            auto const& s = slots[n % feed::capacity];
+            if (s.sequence.load(std::memory_order_acquire) != n + 1) return std::nullopt;
+
+            auto e = feed::event();
+            e.sequence = n;
+            e.kind = s.kind;
+            e.depth = s.depth;
+            e.truncated = s.truncated != 0;
+            e.name.assign(s.name, std::min<std::size_t>(s.name_length, feed::name_size));
+            e.text.assign(s.text, std::min<std::size_t>(s.text_length, feed::text_size));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.sequence.load(std::memory_order_relaxed) != n + 1) return std::nullopt;
+            return e;
+        }
+
+    private:
+        boost::interprocess::mapped_region region;
+        feed::header const* header;
+        feed::slot const* slots;
+    };
+}
+
+#endif // PPSTEP_EVENT_FEED_HPP
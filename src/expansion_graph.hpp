@@ -0,0 +1,160 @@
+#ifndef PPSTEP_EXPANSION_GRAPH_HPP
+#define PPSTEP_EXPANSION_GRAPH_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <ostream>
+
+#include "protocol.hpp"
+
+namespace ppstep {
+    struct expansion_node {
+        std::string call;
+        std::string expanded;
+        std::string rescanned;
+        std::vector<std::size_t> children;
+        std::size_t occurrences;
+    };
+
+    // Records the call -> expanded -> rescanned tree of every macro expansion in a translation unit. Subtrees
+    // are hash-consed: two expansions with the same call, the same results and the same (already shared)
+    // children are stored as a single node, so repeated sub-expansions cost one node plus a counter.
+    struct expansion_graph {
+        expansion_graph() : total(0) {}
+
+        template <class ContainerT>
+        void called(ContainerT const& call) {
+            open.push_back({join_tokens(call), std::string(), {}});
+        }
+
+        template <class ContainerT>
+        void expanded(ContainerT const& result) {
+            if (open.empty()) return;
+            open.back().expanded = join_tokens(result);
+        }
+
+        template <class ContainerT>
+        void rescanned(ContainerT const& result) {
+            if (open.empty()) return;
+
+            auto frame = std::move(open.back());
+            open.pop_back();
+
+            auto id = intern(std::move(frame), join_tokens(result));
+            (open.empty() ? roots : open.back().children).push_back(id);
+        }
+
+        std::size_t total_expansions() const {
+            return total;
+        }
+
+        std::size_t unique_expansions() const {
+            return nodes.size();
+        }
+
+        void write_json(std::ostream& os) const {
+            auto w = json_writer();
+            w.begin_object()
+                .key("total").value(total)
+                .key("unique").value(nodes.size())
+                .key("roots").begin_array();
+            for (auto id : roots) w.value(id);
+            w.end_array().key("nodes").begin_array();
+            for (auto const& node : nodes) {
+                w.begin_object()
+                    .key("call").value(node.call)
+                    .key("expanded").value(node.expanded)
+                    .key("rescanned").value(node.rescanned)
+                    .key("count").value(node.occurrences)
+                    .key("children").begin_array();
+                for (auto child : node.children) w.value(child);
+                w.end_array().end_object();
+            }
+            w.end_array().end_object();
+            os << w.buffer << '\n';
+        }
+
+        void write_dot(std::ostream& os) const {
+            os << "digraph expansions {\n";
+            os << "  node [shape=box, fontname=monospace];\n";
+            for (std::size_t id = 0; id != nodes.size(); ++id) {
+                auto const& node = nodes[id];
+                os << "  n" << id << " [label=\"" << dot_escape(node.call) << "\\l=> " << dot_escape(node.rescanned) << "\\l";
+                if (node.occurrences > 1) os << "x" << node.occurrences << "\\l";
+                os << "\"];\n";
+
+                // collapse repeated edges to the same child into one labelled edge
+                auto multiplicity = std::unordered_map<std::size_t, std::size_t>();
+                for (auto child : node.children) ++multiplicity[child];
+                for (auto child : node.children) {
+                    auto it = multiplicity.find(child);
+                    if (it == multiplicity.end()) continue;
+
+                    os << "  n" << id << " -> n" << child;
+                    if (it->second > 1) os << " [label=\"x" << it->second << "\"]";
+                    os << ";\n";
+                    multiplicity.erase(it);
+                }
+            }
+            os << "}\n";
+        }
+
+    private:
+        struct open_expansion {
+            std::string call;
+            std::string expanded;
+            std::vector<std::size_t> children;
+        };
+
+        template <class ContainerT>
+        static std::string join_tokens(ContainerT const& tokens) {
+            auto acc = std::string();
+            for (auto const& token : tokens) {
+                if (!acc.empty()) acc += ' ';
+                acc.append(token.get_value().c_str(), token.get_value().size());
+            }
+            return acc;
+        }
+
+        static std::string dot_escape(std::string_view str) {
+            auto acc = std::string();
+            for (char c : str) {
+                if (c == '"' || c == '\\') acc += '\\';
+                acc += c;
+            }
+            return acc;
+        }
+
+        std::size_t intern(open_expansion&& frame, std::string rescanned) {
+            ++total;
+
+            auto key = frame.call;
+            key += '\0';
+            key += frame.expanded;
+            key += '\0';
+            key += rescanned;
+            key += '\0';
+            for (auto child : frame.children) {
+                key += std::to_string(child);
+                key += ',';
+            }
+
+            auto [it, inserted] = interned.try_emplace(std::move(key), nodes.size());
+            if (inserted) {
+                nodes.push_back({std::move(frame.call), std::move(frame.expanded), std::move(rescanned), std::move(frame.children), 0});
+            }
+            ++nodes[it->second].occurrences;
+            return it->second;
+        }
+
+        std::vector<open_expansion> open;
+        std::vector<expansion_node> nodes;
+        std::unordered_map<std::string, std::size_t> interned;
+        std::vector<std::size_t> roots;
+        std::size_t total;
+    };
+}
+
+#endif // PPSTEP_EXPANSION_GRAPH_HPP
@@ -0,0 +1,113 @@
+#ifndef PPSTEP_EXPANSION_RECORDING_HPP
+#define PPSTEP_EXPANSION_RECORDING_HPP
+
+#include <string>
+#include <vector>
+#include <variant>
+#include <type_traits>
+
+namespace ppstep {
+    // The events a client received during one expansion, as the server delivered them. Replaying them into
+    // a fresh client (with the server's expansion stacks rebuilt alongside) is indistinguishable from running
+    // the expansion again, as long as the macro table has not changed in the meantime.
+    template <class TokenT, class ContainerT>
+    struct expansion_recording {
+        struct function_call {
+            TokenT macro;
+            ContainerT call;
+
+            template <class ContextT, class ClientT, class StateT>
+            void replay(ContextT& ctx, ClientT& client, StateT& state) const {
+                client.on_expand_function(ctx, macro, std::vector<ContainerT>(), call);
+                state.expanding.push_back(call);
+            }
+        };
+
+        struct object_call {
+            TokenT call;
+
+            template <class ContextT, class ClientT, class StateT>
+            void replay(ContextT& ctx, ClientT& client, StateT& state) const {
+                client.on_expand_object(ctx, call);
+                state.expanding.push_back({call});
+            }
+        };
+
+        struct expanded {
+            ContainerT initial, result;
+
+            template <class ContextT, class ClientT, class StateT>
+            void replay(ContextT& ctx, ClientT& client, StateT& state) const {
+                client.on_expanded(ctx, initial, result);
+                state.rescanning.push_back({std::move(state.expanding.back()), result});
+                state.expanding.pop_back();
+            }
+        };
+
+        struct rescanned {
+            ContainerT cause, initial, result;
+
+            template <class ContextT, class ClientT, class StateT>
+            void replay(ContextT& ctx, ClientT& client, StateT& state) const {
+                client.on_rescanned(ctx, cause, initial, result);
+                state.rescanning.pop_back();
+            }
+        };
+
+        using event = std::variant<function_call, object_call, expanded, rescanned>;
+
+        void called(TokenT const& macro, ContainerT const& call) {
+            events.push_back(function_call{macro, call});
+        }
+
+        void called(TokenT const& call) {
+            events.push_back(object_call{call});
+        }
+
+        void expanded_to(ContainerT const& initial, ContainerT const& result) {
+            events.push_back(expanded{initial, result});
+        }
+
+        void rescanned_to(ContainerT const& cause, ContainerT const& initial, ContainerT const& result) {
+            events.push_back(rescanned{cause, initial, result});
+        }
+
+        template <class ContextT, class ClientT, class StateT>
+        void replay(ContextT& ctx, ClientT& client, StateT& state) const {
+            for (auto const& e : events) {
+                std::visit([&](auto const& recorded) { recorded.replay(ctx, client, state); }, e);
+            }
+        }
+
+        // Dynamic predefined macros give a different result every time, so expansions touching them are not
+        // worth keeping.
+        bool is_repeatable() const {
+            auto repeatable = [](ContainerT const& tokens) {
+                for (auto const& token : tokens) {
+                    auto const& value = token.get_value();
+                    if (value == "__LINE__" || value == "__FILE__" || value == "__COUNTER__" || value == "__DATE__"
+                            || value == "__TIME__" || value == "__INCLUDE_LEVEL__") {
+                        return false;
+                    }
+                }
+                return true;
+            };
+
+            for (auto const& e : events) {
+                bool ok = std::visit([&](auto const& recorded) {
+                    using recorded_type = std::decay_t<decltype(recorded)>;
+                    if constexpr (std::is_same_v<recorded_type, function_call>) return repeatable(recorded.call);
+                    else if constexpr (std::is_same_v<recorded_type, object_call>) return repeatable({recorded.call});
+                    else if constexpr (std::is_same_v<recorded_type, expanded>) return repeatable(recorded.result);
+                    else return repeatable(recorded.result);
+                }, e);
+                if (!ok) return false;
+            }
+            return true;
+        }
+
+        std::vector<event> events;
+    };
+}
+
+#endif // PPSTEP_EXPANSION_RECORDING_HPP
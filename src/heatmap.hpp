@@ -0,0 +1,181 @@
+#ifndef PPSTEP_HEATMAP_HPP
+#define PPSTEP_HEATMAP_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <ostream>
+#include <iomanip>
+#include <utility>
+#include <algorithm>
+
+#include "hook_timings.hpp"
+#include "protocol.hpp"
+
+namespace ppstep {
+    struct line_cost {
+        std::size_t calls = 0;
+        std::size_t expansions = 0;
+        std::size_t rescans = 0;
+        std::size_t tokens = 0;
+        std::uint64_t time = 0;
+
+        bool empty() const {
+            return !calls && !expansions && !rescans && !tokens && !time;
+        }
+    };
+
+    // Attributes preprocessing cost to the source line being preprocessed when it was incurred. Cost inside
+    // an included file is charged to its own lines, and additionally to the #include lines that led to it.
+    struct source_heatmap {
+        enum class cost_kind { call, expansion, rescan, token };
+
+        source_heatmap() : last_file_name(nullptr), last_file(nullptr), last(now()) {}
+
+        template <class PositionT>
+        void charge(PositionT const& pos, cost_kind kind) {
+            auto elapsed = now() - last;
+            last += elapsed;
+
+            auto& entry = line_entry(pos.get_file().c_str(), pos.get_line());
+            add(entry.self, kind, elapsed);
+            for (auto const& [lines, line] : include_stack) {
+                add((*lines)[line].included, kind, elapsed);
+            }
+        }
+
+        template <class PositionT>
+        void enter_include(PositionT const& pos) {
+            line_entry(pos.get_file().c_str(), pos.get_line());
+            include_stack.emplace_back(last_file, pos.get_line());
+        }
+
+        void leave_include() {
+            if (!include_stack.empty()) include_stack.pop_back();
+        }
+
+        void write_json(std::ostream& os) const {
+            auto w = json_writer();
+            w.begin_object().key("unit").value(cycle_clock::unit).key("files").begin_array();
+            for (auto const& [file, lines] : files) {
+                w.begin_object().key("file").value(file).key("lines").begin_array();
+                for (std::size_t line = 0; line != lines.size(); ++line) {
+                    auto const& entry = lines[line];
+                    if (entry.self.empty() && entry.included.empty()) continue;
+
+                    w.begin_object().key("line").value(line);
+                    write_cost(w, entry.self);
+                    if (!entry.included.empty()) {
+                        w.key("included").begin_object();
+                        write_cost(w, entry.included);
+                        w.end_object();
+                    }
+                    w.end_object();
+                }
+                w.end_array().end_object();
+            }
+            w.end_array().end_object();
+            os << w.buffer << '\n';
+        }
+
+        void write_csv(std::ostream& os) const {
+            os << "file,line,calls,expansions,rescans,tokens,time,"
+                  "included_calls,included_expansions,included_rescans,included_tokens,included_time\n";
+            for (auto const& [file, lines] : files) {
+                for (std::size_t line = 0; line != lines.size(); ++line) {
+                    auto const& entry = lines[line];
+                    if (entry.self.empty() && entry.included.empty()) continue;
+
+                    os << '"';
+                    for (char c : file) {
+                        if (c == '"') os << '"';
+                        os << c;
+                    }
+                    os << "\"," << line;
+                    for (auto const* cost : {&entry.self, &entry.included}) {
+                        os << ',' << cost->calls << ',' << cost->expansions << ',' << cost->rescans
+                           << ',' << cost->tokens << ',' << cost->time;
+                    }
+                    os << '\n';
+                }
+            }
+        }
+
+        // Every file that incurred any cost, line by line, with the costs in front of the source text.
+        void write_annotated(std::ostream& os) const {
+            for (auto const& [file, lines] : files) {
+                os << "==> " << file << " <==\n";
+                os << std::setw(8) << "calls" << std::setw(8) << "expands" << std::setw(8) << "rescans"
+                   << std::setw(8) << "tokens" << std::setw(14) << cycle_clock::unit << std::setw(14) << "incl. " + std::string(cycle_clock::unit)
+                   << " | source\n";
+
+                std::ifstream source(file);
+                std::string text;
+                for (std::size_t line = 1; std::getline(source, text); ++line) {
+                    if (line < lines.size() && !(lines[line].self.empty() && lines[line].included.empty())) {
+                        auto const& entry = lines[line];
+                        os << std::setw(8) << entry.self.calls << std::setw(8) << entry.self.expansions
+                           << std::setw(8) << entry.self.rescans << std::setw(8) << entry.self.tokens
+                           << std::setw(14) << entry.self.time;
+                        if (entry.included.empty()) os << std::setw(14) << ""; else os << std::setw(14) << entry.included.time;
+                    } else {
+                        os << std::setw(8 * 4 + 14 * 2) << "";
+                    }
+                    os << " | " << text << '\n';
+                }
+                os << '\n';
+            }
+        }
+
+    private:
+        struct line_costs {
+            line_cost self;
+            line_cost included;
+        };
+
+        static std::uint64_t now() {
+            return cycle_clock::now() - hook_timings::local().excluded;
+        }
+
+        static void add(line_cost& cost, cost_kind kind, std::uint64_t elapsed) {
+            switch (kind) {
+                case cost_kind::call: ++cost.calls; break;
+                case cost_kind::expansion: ++cost.expansions; break;
+                case cost_kind::rescan: ++cost.rescans; break;
+                case cost_kind::token: ++cost.tokens; break;
+            }
+            cost.time += elapsed;
+        }
+
+        static void write_cost(json_writer& w, line_cost const& cost) {
+            w.key("calls").value(cost.calls)
+             .key("expansions").value(cost.expansions)
+             .key("rescans").value(cost.rescans)
+             .key("tokens").value(cost.tokens)
+             .key("time").value(std::size_t(cost.time));
+        }
+
+        line_costs& line_entry(char const* file, std::size_t line) {
+            if (!last_file || *last_file_name != file) {
+                auto it = files.find(file);
+                if (it == files.end()) it = files.emplace(file, std::vector<line_costs>()).first;
+                last_file_name = &(it->first);
+                last_file = &(it->second);
+            }
+
+            if (line >= last_file->size()) last_file->resize(std::max(line + 1, last_file->size() * 2));
+            return (*last_file)[line];
+        }
+
+        std::map<std::string, std::vector<line_costs>> files;
+        std::string const* last_file_name;
+        std::vector<line_costs>* last_file;
+
+        std::vector<std::pair<std::vector<line_costs>*, std::size_t>> include_stack; // #include lines, by file and index
+        std::uint64_t last;
+    };
+}
+
+#endif // PPSTEP_HEATMAP_HPP
@@ -0,0 +1,204 @@
+#ifndef PPSTEP_HOOK_TIMINGS_HPP
+#define PPSTEP_HOOK_TIMINGS_HPP
+
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <ostream>
+#include <iomanip>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifndef PPSTEP_HOOK_TIMINGS
+#define PPSTEP_HOOK_TIMINGS 1
+#endif
+
+namespace ppstep {
+    enum class timed_hook {
+        expanding_function_like_macro,
+        expanding_object_like_macro,
+        expanded_macro,
+        rescanned_macro,
+        lexed_token,
+        on_expanded,
+        on_rescanned,
+        match,
+        splice_between,
+        count
+    };
+
+    inline char const* get_timed_hook_name(timed_hook hook) {
+        switch (hook) {
+            case timed_hook::expanding_function_like_macro: return "expanding_function_like_macro";
+            case timed_hook::expanding_object_like_macro: return "expanding_object_like_macro";
+            case timed_hook::expanded_macro: return "expanded_macro";
+            case timed_hook::rescanned_macro: return "rescanned_macro";
+            case timed_hook::lexed_token: return "lexed_token";
+            case timed_hook::on_expanded: return "client::on_expanded";
+            case timed_hook::on_rescanned: return "client::on_rescanned";
+            case timed_hook::match: return "client::match";
+            case timed_hook::splice_between: return "client::splice_between";
+            default: return "";
+        }
+    }
+
+    // Reads the cheapest monotonic counter available: the timestamp counter on x86, nanoseconds elsewhere.
+    struct cycle_clock {
+#if defined(__x86_64__) || defined(__i386__)
+        static constexpr char const* unit = "cycles";
+
+        static std::uint64_t now() {
+            return __rdtsc();
+        }
+#else
+        static constexpr char const* unit = "ns";
+
+        static std::uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+#endif
+    };
+
+    // Log-bucketed histogram: each power of two is split into four linear sub-buckets, so percentiles are
+    // reported to within 25% of the true value while recording stays a handful of instructions.
+    struct latency_histogram {
+        static constexpr unsigned sub_bucket_bits = 2;
+        static constexpr unsigned bucket_count = 64 << sub_bucket_bits;
+
+        latency_histogram() : buckets(), samples(0), max(0) {}
+
+        void record(std::uint64_t value) {
+            ++buckets[bucket_of(value)];
+            ++samples;
+            if (value > max) max = value;
+        }
+
+        // Upper bound of the bucket holding the given percentile.
+        std::uint64_t percentile(double p) const {
+            if (samples == 0) return 0;
+
+            auto rank = static_cast<std::uint64_t>(p / 100.0 * (samples - 1)) + 1;
+            std::uint64_t seen = 0;
+            for (unsigned i = 0; i != bucket_count; ++i) {
+                seen += buckets[i];
+                if (seen >= rank) return std::min(upper_bound_of(i), max);
+            }
+            return max;
+        }
+
+        std::uint64_t count() const {
+            return samples;
+        }
+
+        std::uint64_t maximum() const {
+            return max;
+        }
+
+    private:
+        static unsigned bucket_of(std::uint64_t value) {
+            if (value < (1u << sub_bucket_bits)) return static_cast<unsigned>(value);
+
+            unsigned msb = 63 - __builtin_clzll(value);
+            auto sub = static_cast<unsigned>(value >> (msb - sub_bucket_bits)) & ((1u << sub_bucket_bits) - 1);
+            return ((msb - sub_bucket_bits + 1) << sub_bucket_bits) + sub;
+        }
+
+        static std::uint64_t upper_bound_of(unsigned bucket) {
+            if (bucket < (1u << sub_bucket_bits)) return bucket;
+
+            unsigned shift = (bucket >> sub_bucket_bits) - 1;
+            auto sub = std::uint64_t(bucket & ((1u << sub_bucket_bits) - 1));
+            return (((std::uint64_t(1) << sub_bucket_bits) + sub + 1) << shift) - 1;
+        }
+
+        std::array<std::uint64_t, bucket_count> buckets;
+        std::uint64_t samples;
+        std::uint64_t max;
+    };
+
+    // Per-thread timings of ppstep's own hooks. Time spent waiting at the prompt is excluded, so a hook that
+    // hands control to the user is charged only for its own bookkeeping.
+    struct hook_timings {
+        static hook_timings& local() {
+            thread_local hook_timings timings;
+            return timings;
+        }
+
+        void record(timed_hook hook, std::uint64_t elapsed) {
+            histograms[static_cast<std::size_t>(hook)].record(elapsed);
+        }
+
+        void reset() {
+            histograms = {};
+        }
+
+        void print(std::ostream& os) const {
+            os << std::left << std::setw(32) << "hook" << std::right
+               << std::setw(12) << "count" << std::setw(12) << "p50" << std::setw(12) << "p99" << std::setw(14) << "max"
+               << "  (" << cycle_clock::unit << ")\n";
+            for (std::size_t i = 0; i != histograms.size(); ++i) {
+                auto const& histogram = histograms[i];
+                os << std::left << std::setw(32) << get_timed_hook_name(static_cast<timed_hook>(i)) << std::right
+                   << std::setw(12) << histogram.count()
+                   << std::setw(12) << histogram.percentile(50)
+                   << std::setw(12) << histogram.percentile(99)
+                   << std::setw(14) << histogram.maximum() << '\n';
+            }
+            os << std::flush;
+        }
+
+        std::uint64_t excluded = 0;
+
+    private:
+        hook_timings() = default;
+
+        std::array<latency_histogram, static_cast<std::size_t>(timed_hook::count)> histograms;
+    };
+
+    struct hook_timer {
+        explicit hook_timer(timed_hook hook) : hook(hook), excluded(hook_timings::local().excluded), start(cycle_clock::now()) {}
+
+        ~hook_timer() {
+            auto end = cycle_clock::now();
+            auto& timings = hook_timings::local();
+            auto elapsed = end - start;
+            auto paused = timings.excluded - excluded;
+            timings.record(hook, elapsed > paused ? elapsed - paused : 0);
+        }
+
+    private:
+        timed_hook hook;
+        std::uint64_t excluded;
+        std::uint64_t start;
+    };
+
+    // Excludes its lifetime from every enclosing hook_timer. A pause nested in another (a prompt inside an
+    // expand session) is already part of the outer one's lifetime, so the outer one overwrites what the inner
+    // one added rather than adding to it.
+    struct hook_timer_pause {
+        hook_timer_pause() : excluded(hook_timings::local().excluded), start(cycle_clock::now()) {}
+
+        ~hook_timer_pause() {
+            hook_timings::local().excluded = excluded + (cycle_clock::now() - start);
+        }
+
+    private:
+        std::uint64_t excluded;
+        std::uint64_t start;
+    };
+}
+
+#if PPSTEP_HOOK_TIMINGS
+#define PPSTEP_TIME_HOOK(hook) ppstep::hook_timer ppstep_hook_timer_(ppstep::timed_hook::hook)
+#else
+#define PPSTEP_TIME_HOOK(hook) ((void)0)
+#endif
+
+// Pauses happen at the prompt, off the hot path, so they are kept even without hook timings; other
+// cost accounting (such as the source heatmap) relies on the excluded time as well.
+#define PPSTEP_PAUSE_HOOK_TIMERS() ppstep::hook_timer_pause ppstep_hook_timer_pause_
+
+#endif // PPSTEP_HOOK_TIMINGS_HPP
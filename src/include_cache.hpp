@@ -0,0 +1,205 @@
+#ifndef PPSTEP_INCLUDE_CACHE_HPP
+#define PPSTEP_INCLUDE_CACHE_HPP
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <utility>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+#include <boost/wave/util/filesystem_compatibility.hpp>
+
+namespace ppstep {
+    // Resolves #include names against the -I search paths without stat-ing every candidate. Each directory
+    // is listed once, on first use, and lookups into it become hash probes; whole-search results (including
+    // misses) are memoized per include name. Listings can be persisted to disk, keyed by directory mtime.
+    struct include_cache {
+        using path_type = boost::filesystem::path;
+
+        include_cache() : dirty(false) {}
+
+        include_cache(std::string persist_file) : persist_file(std::move(persist_file)), dirty(false) {
+            load();
+        }
+
+        void add_include_path(std::string const& path) {
+            user_paths.emplace_back(boost::filesystem::absolute(boost::wave::util::create_path(path)), path);
+            resolved_user.clear();
+        }
+
+        void add_sysinclude_path(std::string const& path) {
+            system_paths.emplace_back(boost::filesystem::absolute(boost::wave::util::create_path(path)), path);
+            resolved_system.clear();
+        }
+
+        // Mirrors boost::wave::util::include_paths::find_include_file for the case without a
+        // system include delimiter and without #include_next.
+        bool find_include_file(std::string& s, std::string& dir, bool is_system,
+                               path_type const& current_dir, path_type const& current_rel_dir) {
+            auto name = boost::wave::util::create_path(s);
+
+            if (!is_system) {
+                auto local = name.has_root_directory() ? name : current_dir / name;
+                if (exists(local)) {
+                    auto dirpath = name.has_root_directory() ? name : current_rel_dir / name;
+                    dir = dirpath.string();
+                    s = boost::wave::util::normalize(local).string();
+                    return true;
+                }
+
+                if (search(s, dir, user_paths, resolved_user)) return true;
+            }
+
+            return search(s, dir, system_paths, resolved_system);
+        }
+
+        bool exists(path_type const& file) {
+            auto leaf = file.filename();
+            if (leaf.empty() || leaf == "." || leaf == "..") {
+                return boost::filesystem::exists(file);
+            }
+
+            auto const& entries = listing(file.parent_path());
+            return entries.find(leaf.string()) != entries.end();
+        }
+
+        void save() {
+            if (!dirty || persist_file.empty()) return;
+
+            auto temp_file = persist_file + ".tmp";
+            {
+                std::ofstream out(temp_file, std::ios::trunc);
+                if (!out) return;
+
+                out << header << '\n';
+                for (auto const& [dirname, entry] : listings) {
+                    if (!entry.mtime) continue;
+
+                    out << *entry.mtime << '\t' << entry.names.size() << '\t' << dirname << '\n';
+                    for (auto const& name : entry.names) {
+                        out << name << '\n';
+                    }
+                }
+                if (!out) return;
+            }
+
+            boost::system::error_code ec;
+            boost::filesystem::rename(temp_file, persist_file, ec);
+            if (!ec) dirty = false;
+        }
+
+    private:
+        struct directory_listing {
+            std::optional<std::time_t> mtime;
+            std::unordered_set<std::string> names;
+            bool verified = false;
+        };
+
+        using search_path_list = std::vector<std::pair<path_type, std::string>>;
+
+        using resolution_cache = std::unordered_map<std::string, std::optional<std::pair<std::string, std::string>>>;
+
+        static constexpr auto header = "ppstep-include-cache 1";
+
+        bool search(std::string& s, std::string& dir, search_path_list const& paths, resolution_cache& resolved) {
+            auto memo = resolved.find(s);
+            if (memo == resolved.end()) {
+                memo = resolved.emplace(s, search_uncached(s, paths)).first;
+            }
+
+            if (!memo->second) return false;
+
+            std::tie(s, dir) = *(memo->second);
+            return true;
+        }
+
+        std::optional<std::pair<std::string, std::string>> search_uncached(std::string const& s, search_path_list const& paths) {
+            auto name = boost::wave::util::create_path(s);
+
+            for (auto const& [full_path, given_path] : paths) {
+                auto candidate = name.has_root_directory() ? name : full_path / name;
+                if (!exists(candidate)) continue;
+
+                auto dirpath = name.has_root_directory() ? name : boost::wave::util::create_path(given_path) / name;
+                return {{boost::wave::util::normalize(candidate).string(), dirpath.string()}};
+            }
+            return {};
+        }
+
+        std::unordered_set<std::string> const& listing(path_type const& dirpath) {
+            auto& entry = listings[dirpath.empty() ? std::string(".") : dirpath.string()];
+            if (entry.verified) return entry.names;
+            entry.verified = true;
+
+            namespace fs = boost::filesystem;
+            auto native_dir = dirpath.empty() ? path_type(".") : dirpath;
+
+            boost::system::error_code ec;
+            auto mtime = fs::last_write_time(native_dir, ec);
+            if (ec || !fs::is_directory(native_dir, ec)) {
+                entry.mtime.reset();
+                entry.names.clear();
+                return entry.names;
+            }
+
+            if (entry.mtime && *entry.mtime == mtime) return entry.names; // persisted listing still valid
+
+            entry.mtime = mtime;
+            entry.names.clear();
+            for (fs::directory_iterator it(native_dir, ec), end; !ec && it != end; it.increment(ec)) {
+                entry.names.insert(it->path().filename().string());
+            }
+            dirty = true;
+
+            return entry.names;
+        }
+
+        void load() {
+            std::ifstream in(persist_file);
+            if (!in) return;
+
+            auto line = std::string();
+            if (!std::getline(in, line) || line != header) return;
+
+            while (std::getline(in, line)) {
+                auto first_tab = line.find('\t');
+                auto second_tab = first_tab == std::string::npos ? first_tab : line.find('\t', first_tab + 1);
+                if (second_tab == std::string::npos) break;
+
+                long long mtime;
+                unsigned long long count;
+                try {
+                    mtime = std::stoll(line.substr(0, first_tab));
+                    count = std::stoull(line.substr(first_tab + 1, second_tab - first_tab - 1));
+                } catch (std::logic_error const&) {
+                    // a damaged file is worth no more than a missing one
+                    listings.clear();
+                    return;
+                }
+
+                auto& entry = listings[line.substr(second_tab + 1)];
+                entry.mtime = static_cast<std::time_t>(mtime);
+
+                for (std::size_t i = 0; i != count && std::getline(in, line); ++i) {
+                    entry.names.insert(line);
+                }
+            }
+        }
+
+        std::string persist_file;
+        bool dirty;
+
+        search_path_list user_paths;
+        search_path_list system_paths;
+
+        std::unordered_map<std::string, directory_listing> listings;
+        resolution_cache resolved_user;
+        resolution_cache resolved_system;
+    };
+}
+
+#endif // PPSTEP_INCLUDE_CACHE_HPP
@@ -0,0 +1,216 @@
+#ifndef PPSTEP_MACRO_INDEX_HPP
+#define PPSTEP_MACRO_INDEX_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <ostream>
+
+#include <boost/wave/token_ids.hpp>
+
+namespace ppstep {
+    struct macro_info {
+        std::string name;
+        bool is_functionlike;
+        bool is_predefined;
+        std::vector<std::string> parameters;
+        std::string definition;
+
+        // Identifiers in the definition other than its parameters, sorted; not all of them need to be macros.
+        std::vector<std::string> references;
+
+        std::string file;
+        std::size_t line, column;
+
+        std::ostream& print_signature(std::ostream& os) const {
+            os << name;
+            if (is_functionlike) {
+                os << '(';
+
+                auto it = parameters.begin();
+                auto end = parameters.end();
+
+                if (it != end)
+                    os << *it++;
+
+                for (; it != end; ++it)
+                    os << ", " << *it;
+
+                os << ')';
+            }
+            return os;
+        }
+    };
+
+    // Kept up to date by the server's defined_macro/undefined_macro hooks, so that listing, filtering and
+    // looking up macros never has to walk the context's macro table. The same goes for which macros a
+    // definition refers to and, the other way around, which macros refer to a name.
+    struct macro_index {
+        macro_index() : changes(0) {}
+
+        template <class TokenT, class ParametersT, class DefinitionT>
+        void define(TokenT const& name, bool is_functionlike, ParametersT const& parameters, DefinitionT const& definition, bool is_predefined) {
+            auto key = std::string(name.get_value().c_str());
+
+            auto info = macro_info();
+            info.name = key;
+            info.is_functionlike = is_functionlike;
+            info.is_predefined = is_predefined;
+            for (auto const& param : parameters) {
+                info.parameters.emplace_back(param.get_value().c_str());
+            }
+            for (auto const& token : definition) {
+                info.definition += token.get_value().c_str();
+                if (boost::wave::token_id(token) == boost::wave::T_IDENTIFIER) {
+                    info.references.emplace_back(token.get_value().c_str());
+                }
+            }
+
+            auto& refs = info.references;
+            std::sort(refs.begin(), refs.end());
+            refs.erase(std::unique(refs.begin(), refs.end()), refs.end());
+            refs.erase(std::remove_if(refs.begin(), refs.end(), [&](std::string const& ref) {
+                return ref == key || ref == "__VA_ARGS__" || ref == "__VA_OPT__"
+                        || std::find(info.parameters.begin(), info.parameters.end(), ref) != info.parameters.end();
+            }), refs.end());
+
+            auto const& pos = name.get_position();
+            info.file = pos.get_file().c_str();
+            info.line = pos.get_line();
+            info.column = pos.get_column();
+
+            ++changes;
+            auto existing = entries.find(key);
+            if (existing != entries.end()) unlink(existing->second);
+
+            auto [it, inserted] = entries.insert_or_assign(std::move(key), std::move(info));
+            if (inserted) {
+                sorted_names.emplace(it->first, &(it->second));
+            }
+            for (auto const& ref : it->second.references) {
+                referrers[ref].insert(it->first);
+            }
+        }
+
+        template <class TokenT>
+        void undefine(TokenT const& name) {
+            auto it = entries.find(name.get_value().c_str());
+            if (it == entries.end()) return;
+
+            ++changes;
+            unlink(it->second);
+            sorted_names.erase(it->first);
+            entries.erase(it);
+        }
+
+        void clear() {
+            ++changes;
+            referrers.clear();
+            sorted_names.clear();
+            entries.clear();
+        }
+
+        macro_info const* find(std::string const& name) const {
+            auto it = entries.find(name);
+            return it != entries.end() ? &(it->second) : nullptr;
+        }
+
+        // Visits macros whose names start with the given prefix, in sorted order, until the visitor returns false.
+        template <class Visitor>
+        void for_each_with_prefix(std::string_view prefix, Visitor&& visitor) const {
+            for (auto it = sorted_names.lower_bound(prefix); it != sorted_names.end(); ++it) {
+                if (it->first.compare(0, prefix.size(), prefix) != 0) break;
+                if (!visitor(*(it->second))) break;
+            }
+        }
+
+        std::size_t size() const {
+            return entries.size();
+        }
+
+        // The defined macros that a macro's definition refers to.
+        std::vector<macro_info const*> uses(std::string const& name) const {
+            auto found = std::vector<macro_info const*>();
+            if (auto const* info = find(name)) {
+                for (auto const& ref : info->references) {
+                    if (auto const* used = find(ref)) found.push_back(used);
+                }
+            }
+            return found;
+        }
+
+        // The macros whose definitions refer to a name, whether or not that name is itself defined.
+        std::vector<macro_info const*> used_by(std::string const& name) const {
+            auto found = std::vector<macro_info const*>();
+            auto it = referrers.find(name);
+            if (it == referrers.end()) return found;
+
+            for (auto user : it->second) found.push_back(find(std::string(user)));
+            return found;
+        }
+
+        // The reference graph as DOT, with an edge from each macro to the macros it uses. Given a name, only
+        // the macros reachable from it in either direction are included.
+        void write_dot(std::ostream& os, std::string const& around = std::string()) const {
+            auto included = std::unordered_set<std::string>();
+            if (!around.empty()) {
+                for (bool forward : {true, false}) {
+                    auto pending = std::deque<std::string>{around};
+                    auto seen = std::unordered_set<std::string>{around};
+                    while (!pending.empty()) {
+                        auto name = std::move(pending.front());
+                        pending.pop_front();
+                        for (auto const* next : forward ? uses(name) : used_by(name)) {
+                            if (seen.insert(next->name).second) pending.push_back(next->name);
+                        }
+                    }
+                    included.insert(seen.begin(), seen.end());
+                }
+            }
+
+            auto quoted = [](std::string const& name) {
+                return '"' + name + '"';
+            };
+
+            os << "digraph macros {\n";
+            if (!around.empty()) os << "    " << quoted(around) << " [style=bold];\n";
+            for (auto const& [name, info] : sorted_names) {
+                if (!around.empty() && !included.count(std::string(name))) continue;
+                for (auto const* used : uses(std::string(name))) {
+                    if (!around.empty() && !included.count(used->name)) continue;
+                    os << "    " << quoted(std::string(name)) << " -> " << quoted(used->name) << ";\n";
+                }
+            }
+            os << "}\n";
+        }
+
+        // Changes whenever a macro is defined or undefined; anything derived from the macro table can be
+        // kept for as long as this stays the same.
+        std::size_t generation() const {
+            return changes;
+        }
+
+    private:
+        void unlink(macro_info const& info) {
+            for (auto const& ref : info.references) {
+                auto it = referrers.find(ref);
+                if (it == referrers.end()) continue;
+                it->second.erase(info.name);
+                if (it->second.empty()) referrers.erase(it);
+            }
+        }
+
+        std::unordered_map<std::string, macro_info> entries;
+        std::map<std::string_view, macro_info const*, std::less<>> sorted_names; // views into entries
+        std::unordered_map<std::string, std::set<std::string_view, std::less<>>> referrers; // views into entries
+        std::size_t changes;
+    };
+}
+
+#endif // PPSTEP_MACRO_INDEX_HPP
@@ -0,0 +1,85 @@
+#ifndef PPSTEP_MACRO_PROFILE_HPP
+#define PPSTEP_MACRO_PROFILE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "hook_timings.hpp"
+
+namespace ppstep {
+    struct macro_cost {
+        std::size_t calls = 0;
+        std::size_t events = 0;
+        std::size_t tokens = 0;
+        std::uint64_t time = 0;
+
+        // Deterministic, unlike time, so that runs can be compared exactly.
+        std::size_t work() const {
+            return events + tokens;
+        }
+    };
+
+    // Counts preprocessing events and attributes their cost to macros, along with the tokens each expansion
+    // produced. Costs are self costs: an expansion nested inside another is charged to the inner macro only, so
+    // the costs of all macros add up to the total.
+    struct macro_profile {
+        macro_profile() : calls(0), expansions(0), rescans(0) {}
+
+        template <class TokenT>
+        void called(TokenT const& macrocall) {
+            open.push_back({macrocall.get_value().c_str(), events(), cycle_clock::now(), 0, 0});
+            ++calls;
+        }
+
+        void expanded(std::size_t tokens) {
+            ++expansions;
+            if (!open.empty()) costs[open.back().name].tokens += tokens;
+        }
+
+        void rescanned() {
+            ++rescans;
+            if (open.empty()) return;
+
+            auto frame = std::move(open.back());
+            open.pop_back();
+
+            auto inclusive_events = events() - frame.events;
+            auto inclusive_time = cycle_clock::now() - frame.time;
+
+            auto& cost = costs[frame.name];
+            ++cost.calls;
+            cost.events += inclusive_events - frame.child_events;
+            cost.time += inclusive_time - frame.child_time;
+
+            if (!open.empty()) {
+                open.back().child_events += inclusive_events;
+                open.back().child_time += inclusive_time;
+            }
+        }
+
+        std::size_t events() const {
+            return calls + expansions + rescans;
+        }
+
+        std::unordered_map<std::string, macro_cost> costs;
+
+        std::size_t calls;
+        std::size_t expansions;
+        std::size_t rescans;
+
+    private:
+        struct frame {
+            std::string name;
+            std::size_t events;
+            std::uint64_t time;
+            std::size_t child_events;
+            std::uint64_t child_time;
+        };
+
+        std::vector<frame> open;
+    };
+}
+
+#endif // PPSTEP_MACRO_PROFILE_HPP
@@ -0,0 +1,241 @@
+#ifndef PPSTEP_MATRIX_HPP
+#define PPSTEP_MATRIX_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <istream>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/wave/token_ids.hpp>
+#include <boost/wave/language_support.hpp>
+#include <boost/wave/cpp_exceptions.hpp>
+#include <boost/wave/cpplexer/cpplexer_exceptions.hpp>
+
+#include "server.hpp"
+#include "macro_profile.hpp"
+#include "watchdog.hpp"
+
+namespace ppstep {
+    struct matrix_config {
+        std::string text;
+        std::vector<std::string> includes;
+        std::vector<std::string> defines;
+        std::vector<std::string> undefines;
+    };
+
+    // One configuration per line, as -D/-U/-I options (or their long forms); blank lines and lines starting
+    // with '#' are ignored.
+    inline std::vector<matrix_config> parse_matrix(std::istream& is) {
+        auto configs = std::vector<matrix_config>();
+        std::size_t line_number = 0;
+        for (std::string line; std::getline(is, line);) {
+            ++line_number;
+            auto first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos || line[first] == '#') continue;
+
+            auto config = matrix_config();
+            config.text = line.substr(first, line.find_last_not_of(" \t\r") + 1 - first);
+
+            std::istringstream words(config.text);
+            for (std::string word; words >> word;) {
+                auto option = [&](char const* short_name, char const* long_name, std::vector<std::string>& values) {
+                    auto take = [&](std::string value) {
+                        if (value.empty() && !(words >> value)) {
+                            throw std::runtime_error("line " + std::to_string(line_number) + ": missing argument to " + word);
+                        }
+                        values.push_back(value);
+                        return true;
+                    };
+                    if (word.compare(0, 2, short_name) == 0) return take(word.substr(2));
+                    if (word == long_name) return take("");
+                    if (word.compare(0, std::string(long_name).size() + 1, std::string(long_name) + '=') == 0) {
+                        return take(word.substr(std::string(long_name).size() + 1));
+                    }
+                    return false;
+                };
+
+                if (!option("-D", "--define", config.defines)
+                        && !option("-U", "--undefine", config.undefines)
+                        && !option("-I", "--include", config.includes)) {
+                    throw std::runtime_error("line " + std::to_string(line_number) + ": unknown option " + word);
+                }
+            }
+            configs.push_back(std::move(config));
+        }
+        return configs;
+    }
+
+    struct matrix_result {
+        std::size_t calls = 0;
+        std::size_t expansions = 0;
+        std::size_t rescans = 0;
+        std::size_t tokens = 0;
+        std::size_t output_bytes = 0;
+        std::size_t warnings = 0;
+        double seconds = 0;
+        std::string error;
+        std::unordered_map<std::string, macro_cost> macros;
+    };
+
+    // Preprocesses the translation unit under one configuration, straight through and without a client.
+    template <class ContextT>
+    matrix_result run_configuration(std::string const& input_file, std::string source, matrix_config const& config,
+                                    boost::wave::language_support language, expansion_limits const& limits) {
+        using server_type = typename ContextT::hook_policy_type;
+        using container_type = typename ContextT::token_sequence_type;
+
+        auto result = matrix_result();
+        auto state = server_state<container_type>();
+        state.watchdog.limits = limits;
+        auto profile = macro_profile();
+        auto server = server_type(state);
+        server.profile = &profile;
+
+        auto started = std::chrono::steady_clock::now();
+        try {
+            ContextT ctx(source.begin(), source.end(), input_file.c_str(), server);
+            state.macros->clear();
+            ctx.set_language(language);
+
+            for (auto const& path : config.includes) {
+                ctx.add_include_path(path.c_str());
+                ctx.add_sysinclude_path(path.c_str());
+            }
+            for (auto const& definition : config.defines) {
+                ctx.add_macro_definition(definition);
+            }
+            for (auto const& definition : config.undefines) {
+                ctx.remove_macro_definition(definition, true);
+            }
+
+            auto first = ctx.begin();
+            auto last = ctx.end();
+            while (first != last) {
+                try {
+                    while (first != last) {
+                        auto const& token = *first;
+                        if (!IS_CATEGORY(token, boost::wave::EOFTokenType)) result.output_bytes += token.get_value().size();
+                        if (!server.should_skip_token(token)) ++result.tokens;
+                        ++first;
+                    }
+                } catch (boost::wave::cpp_exception const& e) {
+                    // warnings leave the iterator usable, as with a compiler that keeps going
+                    if (!e.is_recoverable()) throw;
+                    ++result.warnings;
+                }
+            }
+        } catch (limit_exceeded const& e) {
+            result.error = e.what();
+            result.error = result.error.substr(0, result.error.find('\n'));
+        } catch (boost::wave::cpp_exception const& e) {
+            result.error = std::string(e.file_name()) + ":" + std::to_string(e.line_no()) + ": " + e.description();
+        } catch (boost::wave::cpplexer::lexing_exception const& e) {
+            result.error = std::string(e.file_name()) + ":" + std::to_string(e.line_no()) + ": " + e.description();
+        }
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+        result.calls = profile.calls;
+        result.expansions = profile.expansions;
+        result.rescans = profile.rescans;
+        result.macros = std::move(profile.costs);
+        return result;
+    }
+
+    // Runs every configuration, one context per thread and at most one thread per core.
+    template <class ContextT>
+    std::vector<matrix_result> run_matrix(std::string const& input_file, std::string const& source,
+                                          std::vector<matrix_config> const& configs,
+                                          boost::wave::language_support language, expansion_limits const& limits) {
+        auto results = std::vector<matrix_result>(configs.size());
+        auto next = std::atomic<std::size_t>(0);
+
+        auto worker = [&]() {
+            for (auto i = next++; i < configs.size(); i = next++) {
+                results[i] = run_configuration<ContextT>(input_file, source, configs[i], language, limits);
+            }
+        };
+
+        auto thread_count = std::min<std::size_t>(configs.size(), std::max(1u, std::thread::hardware_concurrency()));
+        auto threads = std::vector<std::thread>();
+        for (std::size_t i = 1; i < thread_count; ++i) threads.emplace_back(worker);
+        worker();
+        for (auto& thread : threads) thread.join();
+
+        return results;
+    }
+
+    // Per-configuration totals, followed by the macros whose self cost (events plus tokens produced) varies the
+    // most between configurations.
+    inline void print_matrix_report(std::ostream& os, std::vector<matrix_config> const& configs,
+                                    std::vector<matrix_result> const& results, std::size_t max_macros = 10) {
+        os << std::setw(4) << "#" << std::setw(10) << "calls" << std::setw(12) << "expansions" << std::setw(10) << "rescans"
+           << std::setw(10) << "tokens" << std::setw(12) << "output" << std::setw(10) << "seconds" << "  configuration\n";
+        for (std::size_t i = 0; i != results.size(); ++i) {
+            auto const& result = results[i];
+            os << std::setw(4) << i + 1 << std::setw(10) << result.calls << std::setw(12) << result.expansions
+               << std::setw(10) << result.rescans << std::setw(10) << result.tokens << std::setw(12) << result.output_bytes
+               << std::setw(10) << std::fixed << std::setprecision(3) << result.seconds << "  " << configs[i].text << '\n';
+            if (result.warnings) os << std::setw(4) << "" << "  " << result.warnings << " warning(s)\n";
+            if (!result.error.empty()) os << std::setw(4) << "" << "  error: " << result.error << '\n';
+        }
+
+        if (results.size() < 2) {
+            os << std::flush;
+            return;
+        }
+
+        auto spreads = std::map<std::string, std::pair<std::size_t, std::size_t>>();
+        for (auto const& result : results) {
+            for (auto const& [name, cost] : result.macros) spreads.emplace(name, std::make_pair(~std::size_t(0), 0));
+        }
+        for (auto& [name, spread] : spreads) {
+            for (auto const& result : results) {
+                auto it = result.macros.find(name);
+                auto work = it == result.macros.end() ? 0 : it->second.work();
+                spread.first = std::min(spread.first, work);
+                spread.second = std::max(spread.second, work);
+            }
+        }
+
+        auto ranked = std::vector<std::pair<std::size_t, std::string>>();
+        for (auto const& [name, spread] : spreads) {
+            if (spread.second != spread.first) ranked.emplace_back(spread.second - spread.first, name);
+        }
+        std::sort(ranked.begin(), ranked.end(), [](auto const& a, auto const& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+        if (ranked.size() > max_macros) ranked.resize(max_macros);
+
+        os << "\nlargest differences in macro cost (events + tokens produced):\n";
+        if (ranked.empty()) {
+            os << "  none\n" << std::flush;
+            return;
+        }
+
+        auto name_width = std::size_t(5);
+        for (auto const& [difference, name] : ranked) name_width = std::max(name_width, name.size() + 2);
+        os << std::left << std::setw(name_width) << "macro" << std::right;
+        for (std::size_t i = 0; i != results.size(); ++i) os << std::setw(10) << "#" + std::to_string(i + 1);
+        os << '\n';
+        for (auto const& [difference, name] : ranked) {
+            os << std::left << std::setw(name_width) << name << std::right;
+            for (auto const& result : results) {
+                auto it = result.macros.find(name);
+                os << std::setw(10) << (it == result.macros.end() ? 0 : it->second.work());
+            }
+            os << '\n';
+        }
+        os << std::flush;
+    }
+}
+
+#endif // PPSTEP_MATRIX_HPP
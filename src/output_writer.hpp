@@ -0,0 +1,132 @@
+#ifndef PPSTEP_OUTPUT_WRITER_HPP
+#define PPSTEP_OUTPUT_WRITER_HPP
+
+#include <string>
+#include <fstream>
+
+#include <boost/wave/token_ids.hpp>
+
+#include "source_map.hpp"
+
+namespace ppstep {
+    // Writes the preprocessed token stream to a file, as a compiler's -E would, with #line markers wherever
+    // the output stops following the source line by line. Output is accumulated and written in large blocks.
+    struct output_writer {
+        static constexpr std::size_t buffer_size = 1 << 16;
+
+        // Gaps up to this many lines are filled with blank lines rather than a marker.
+        static constexpr std::size_t max_blank_lines = 8;
+
+        output_writer(std::string const& filename)
+            : map(nullptr), origins(nullptr), out(filename, std::ios::binary | std::ios::trunc), line(0), at_line_start(true),
+              output_line(0), output_column(0) {
+            buffer.reserve(buffer_size);
+        }
+
+        ~output_writer() {
+            flush();
+        }
+
+        output_writer(output_writer const&) = delete;
+        output_writer& operator=(output_writer const&) = delete;
+
+        explicit operator bool() const {
+            return static_cast<bool>(out);
+        }
+
+        template <class ContextT, class TokenT>
+        void write(ContextT const& ctx, TokenT const& token) {
+            if (IS_CATEGORY(token, boost::wave::EOFTokenType)) return;
+
+            auto const& value = token.get_value();
+
+            if (IS_CATEGORY(token, boost::wave::EOLTokenType)) {
+                pending.clear();
+                append(value.c_str(), value.size());
+                ++line;
+                at_line_start = true;
+                return;
+            }
+
+            if (at_line_start) {
+                // hold back indentation until it is known whether a line marker has to go in front of it
+                if (IS_CATEGORY(token, boost::wave::WhiteSpaceTokenType)) {
+                    pending.append(value.c_str(), value.size());
+                    return;
+                }
+
+                sync(ctx.get_main_pos());
+                append(pending.data(), pending.size());
+                pending.clear();
+                at_line_start = false;
+            }
+
+            if (map && origins && !IS_CATEGORY(token, boost::wave::WhiteSpaceTokenType)) {
+                map->add(output_line, output_column, token, *origins);
+            }
+            append(value.c_str(), value.size());
+            for (char c : value) {
+                if (c == '\n') ++line;
+            }
+        }
+
+        void flush() {
+            if (buffer.empty()) return;
+            out.write(buffer.data(), buffer.size());
+            out.flush();
+            buffer.clear();
+        }
+
+        source_map* map;
+        expansion_origins* origins;
+
+    private:
+        template <class PositionT>
+        void sync(PositionT const& pos) {
+            auto const& file = pos.get_file();
+            std::size_t target = pos.get_line();
+
+            if (line != 0 && file == current_file.c_str() && target >= line && target - line <= max_blank_lines) {
+                for (; line < target; ++line) append("\n", 1);
+                return;
+            }
+
+            current_file = file.c_str();
+            line = target;
+
+            auto marker = "#line " + std::to_string(target) + " \"";
+            for (char c : current_file) {
+                if (c == '"' || c == '\\') marker += '\\';
+                marker += c;
+            }
+            marker += "\"\n";
+            append(marker.data(), marker.size());
+        }
+
+        void append(char const* data, std::size_t size) {
+            for (std::size_t i = 0; i != size; ++i) {
+                if (data[i] == '\n') {
+                    ++output_line;
+                    output_column = 0;
+                } else {
+                    ++output_column;
+                }
+            }
+            buffer.append(data, size);
+            if (buffer.size() >= buffer_size) flush();
+        }
+
+        std::ofstream out;
+        std::string buffer;
+        std::string pending;
+
+        std::string current_file;
+        std::size_t line;
+        bool at_line_start;
+
+        std::size_t output_line;
+        std::size_t output_column;
+    };
+}
+
+#endif // PPSTEP_OUTPUT_WRITER_HPP
@@ -1,40 +1,31 @@
 
-#define BOOST_WAVE_ENABLE_COMMANDLINE_MACROS 1
-#define BOOST_NO_MEMBER_TEMPLATE_FRIENDS 1
+#include "preprocessor.hpp"
 
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <list>
 #include <vector>
+#include <optional>
 
-#include <boost/wave.hpp>
-#include <boost/wave/cpplexer/cpp_lex_token.hpp>
-#include <boost/wave/cpplexer/cpp_lex_iterator.hpp>
-#include <boost/wave/cpplexer/re2clex/cpp_re2c_lexer.hpp>
+#include <unistd.h>
 
 #include <boost/program_options.hpp>
 
-#include "client.hpp"
-#include "server.hpp"
+#include "include_cache.hpp"
+#include "protocol.hpp"
+#include "expansion_graph.hpp"
+#include "output_writer.hpp"
+#include "heatmap.hpp"
+#include "matrix.hpp"
+#include "async_output.hpp"
+#include "event_feed.hpp"
+#include "attach.hpp"
 
 
 namespace po = boost::program_options;
 
-using token_type = boost::wave::cpplexer::lex_token<>;
-
-using token_sequence_type = std::list<token_type, boost::fast_pool_allocator<token_type>>;
-
-using lex_iterator_type = boost::wave::cpplexer::lex_iterator<token_type>;
-
-using context_type =
-    boost::wave::context<
-        std::string::iterator,
-        lex_iterator_type,
-        boost::wave::iteration_context_policies::load_file_to_string,
-        ppstep::server<token_type, token_sequence_type>
-    >;
-
-
 static std::string read_entire_file(std::istream&& instream) {
     instream.unsetf(std::ios::skipws);
 
@@ -51,6 +42,34 @@ bool parse_args(int argc, char const** argv, po::variables_map& vm) {
                 "specify a macro to define (as macro[=[value]])")
         ("undefine,U", po::value<std::vector<std::string> >()->composing(),
             "specify a macro to undefine")
+        ("output,o", po::value<std::string>(),
+                "write the preprocessed output to the given file")
+        ("source-map", "write a source map of the preprocessed output, with the macro expansions behind each token, next to it (needs -o)")
+        ("include-cache", po::value<std::string>(),
+                "persist include directory listings to the given file")
+        ("token-cache", po::value<std::string>(),
+                "cache the lexed tokens of included files in the given directory")
+        ("prefetch", po::value<std::size_t>(),
+                "read included files ahead of preprocessing on the given number of background threads")
+        ("expansion-graph", po::value<std::string>(),
+                "write the deduplicated expansion tree to the given file (DOT if it ends in .dot, JSON otherwise)")
+        ("heatmap", po::value<std::string>(),
+                "write per-source-line preprocessing costs to the given file (CSV if it ends in .csv, JSON if .json, annotated source otherwise)")
+        ("matrix", po::value<std::string>(),
+                "preprocess under each configuration (a line of -D/-U/-I options) in the given file in parallel and compare them")
+        ("trace-scope", po::value<std::vector<std::string>>()->composing(),
+                "only trace inside expansions of the given macros (as macro[,macro...])")
+        ("trace-system-headers", po::value<bool>()->default_value(true),
+                "step through headers included with angle brackets (on or off)")
+        ("collapse", po::value<std::size_t>(),
+                "report expansions that call no other macro and produce at most this many tokens as a single step")
+        ("max-depth", po::value<std::size_t>(), "stop when more than this many macro expansions are nested")
+        ("max-tokens", po::value<std::size_t>(), "stop when a single expansion produces more than this many tokens")
+        ("max-events", po::value<std::size_t>(), "stop after this many preprocessing events without reaching a prompt")
+        ("max-time", po::value<std::size_t>(), "stop after running this many seconds without reaching a prompt")
+        ("feed", po::value<std::string>(),
+                "publish events to the named shared memory segment, for `ppstep attach NAME` to follow")
+        ("protocol", "speak newline-delimited JSON over stdin/stdout instead of the interactive prompt")
         ("debug", "enable debug tracing")
         ("input-file", po::value<std::string>()->required(), "input file");
 
@@ -75,6 +94,10 @@ bool parse_args(int argc, char const** argv, po::variables_map& vm) {
 }
 
 int main(int argc, char const** argv) {
+    if (argc > 1 && std::string(argv[1]) == "attach") {
+        return ppstep::attach_main(argc - 1, argv + 1);
+    }
+
     po::variables_map args;
     if (!parse_args(argc, argv, args))
         return 1;
@@ -82,27 +105,131 @@ int main(int argc, char const** argv) {
     char const* input_file = args["input-file"].as<std::string>().c_str();
     auto instring = read_entire_file(std::ifstream(input_file));
 
-    auto server_state = ppstep::server_state<token_sequence_type>();
-    auto client = ppstep::client<token_type, token_sequence_type>(server_state);
-    auto server = ppstep::server<token_type, token_sequence_type>(server_state, client,  args.count("debug"));
-    context_type ctx(instring.begin(), instring.end(), input_file, server);
+    auto server_state = ppstep::server_state<ppstep::token_sequence_type>();
+    auto client = ppstep::client<ppstep::token_type, ppstep::token_sequence_type>(server_state);
+    if (args.count("trace-scope")) {
+        for (auto const& names : args["trace-scope"].as<std::vector<std::string>>()) {
+            std::istringstream ss(names);
+            for (std::string name; std::getline(ss, name, ',');) {
+                if (!name.empty()) server_state.trace_scope.insert(name.c_str());
+            }
+        }
+    }
+
+    server_state.trace_system_headers = args["trace-system-headers"].as<bool>();
+
+    if (args.count("collapse")) {
+        client.set_collapse_threshold(args["collapse"].as<std::size_t>());
+    }
+
+    auto& limits = server_state.watchdog.limits;
+    if (args.count("max-depth")) limits.depth = args["max-depth"].as<std::size_t>();
+    if (args.count("max-tokens")) limits.tokens = args["max-tokens"].as<std::size_t>();
+    if (args.count("max-events")) limits.events = args["max-events"].as<std::size_t>();
+    if (args.count("max-time")) limits.time = std::chrono::seconds(args["max-time"].as<std::size_t>());
+
+    if (args.count("matrix")) {
+        auto const& matrix_file = args["matrix"].as<std::string>();
+        std::ifstream matrix_in(matrix_file);
+        if (!matrix_in) {
+            std::cerr << "error: cannot open matrix file " << matrix_file << std::endl;
+            return 1;
+        }
+
+        auto configs = std::vector<ppstep::matrix_config>();
+        try {
+            configs = ppstep::parse_matrix(matrix_in);
+        } catch (std::runtime_error const& e) {
+            std::cerr << "error: " << matrix_file << ": " << e.what() << std::endl;
+            return 1;
+        }
+
+        // options given on the command line apply to every configuration, ahead of its own
+        for (auto& config : configs) {
+            for (auto [name, values] : {std::make_pair("include", &config.includes), std::make_pair("define", &config.defines), std::make_pair("undefine", &config.undefines)}) {
+                if (!args.count(name)) continue;
+                auto const& common = args[name].as<std::vector<std::string>>();
+                values->insert(values->begin(), common.begin(), common.end());
+            }
+        }
+
+        auto results = ppstep::run_matrix<ppstep::context_type>(input_file, instring, configs, ppstep::language, limits);
+        ppstep::print_matrix_report(std::cout, configs, results);
+        return 0;
+    }
+
+    auto channel = ppstep::protocol_channel(std::cin, std::cout.rdbuf());
+    if (args.count("protocol")) {
+        client.set_protocol(&channel);
+    }
+
+    if (!args.count("debug")) {
+        ppstep::install_interrupt_handler();
+        server_state.progress.enable(!args.count("protocol") && isatty(STDERR_FILENO));
+    }
+
+    auto feed = std::optional<ppstep::event_publisher>();
+    if (args.count("feed")) {
+        auto const& feed_name = args["feed"].as<std::string>();
+        try {
+            feed.emplace(feed_name);
+        } catch (boost::interprocess::interprocess_exception const& e) {
+            std::cerr << "error: cannot create feed " << feed_name << ": " << e.what() << std::endl;
+            return 1;
+        }
+        server_state.feed = &(*feed);
+    }
 
-    static_assert(std::is_same_v<token_sequence_type, typename context_type::token_sequence_type>,
+    auto includes = args.count("include-cache") ? ppstep::include_cache(args["include-cache"].as<std::string>()) : ppstep::include_cache();
+    auto graph = ppstep::expansion_graph();
+    auto server = ppstep::server<ppstep::token_type, ppstep::token_sequence_type>(server_state, client,  args.count("debug"));
+    server.includes = &includes;
+    auto tokens = args.count("token-cache") ? std::make_optional<ppstep::token_cache>(args["token-cache"].as<std::string>()) : std::nullopt;
+    if (tokens) {
+        server.tokens = &(*tokens);
+    }
+    if (args.count("expansion-graph")) {
+        server.graph = &graph;
+    }
+    auto heatmap = ppstep::source_heatmap();
+    if (args.count("heatmap")) {
+        server.heatmap = &heatmap;
+    }
+    auto origins = ppstep::expansion_origins();
+    if (args.count("source-map")) {
+        if (!args.count("output")) {
+            std::cerr << "error: --source-map needs an output file (-o)" << std::endl;
+            return 1;
+        }
+        server.origins = &origins;
+    }
+    auto prefetch = std::optional<ppstep::include_prefetcher>();
+    if (args.count("prefetch") && args["prefetch"].as<std::size_t>() != 0) {
+        prefetch.emplace(args["prefetch"].as<std::size_t>());
+        if (args.count("include")) {
+            for (auto const& path : args["include"].as<std::vector<std::string>>()) {
+                prefetch->add_include_path(path);
+                prefetch->add_sysinclude_path(path);
+            }
+        }
+        prefetch->scan(input_file, instring);
+        server.prefetch = &(*prefetch);
+    }
+    ppstep::context_type ctx(instring.begin(), instring.end(), input_file, server);
+
+    static_assert(std::is_same_v<ppstep::token_sequence_type, typename ppstep::context_type::token_sequence_type>,
                   "wave context token container type not same as expansion tracer token container type");
     
-    ctx.set_language(boost::wave::language_support(
-        boost::wave::support_cpp2a
-        | boost::wave::support_option_va_opt
-        | boost::wave::support_option_convert_trigraphs
-        | boost::wave::support_option_long_long
-        | boost::wave::support_option_include_guard_detection
-        | boost::wave::support_option_emit_pragma_directives
-        | boost::wave::support_option_insert_whitespace));
+    // resetting the language resets the macro table without any undefined_macro notifications
+    server_state.macros->clear();
+    ctx.set_language(ppstep::language);
     
     if (args.count("include")) {
         for (auto const& path : args["include"].as<std::vector<std::string>>()) {
             ctx.add_include_path(path.c_str());
             ctx.add_sysinclude_path(path.c_str());
+            includes.add_include_path(path);
+            includes.add_sysinclude_path(path);
         }
     }
     
@@ -118,22 +245,89 @@ int main(int argc, char const** argv) {
         }
     }
 
+    auto output = std::optional<ppstep::output_writer>();
+    if (args.count("output")) {
+        auto const& output_file = args["output"].as<std::string>();
+        output.emplace(output_file);
+        if (!*output) {
+            std::cerr << "error: cannot open output file " << output_file << std::endl;
+            return 1;
+        }
+    }
+    auto map = ppstep::source_map();
+    if (output && args.count("source-map")) {
+        output->map = &map;
+        output->origins = &origins;
+    }
+
+    // debug output goes to stdout a block at a time from another thread instead of a write per event
+    auto debug_output = std::optional<ppstep::async_output>();
+    if (args.count("debug")) debug_output.emplace(std::cout, STDOUT_FILENO);
+    auto flush_debug_output = [&]() {
+        if (debug_output) debug_output->flush();
+    };
+
+    int status = 0;
     auto first = ctx.begin();
     auto last = ctx.end();
     try {
         server.start(ctx);
         while (first != last) {
+            if (output) output->write(ctx, *first);
             server.lexed_token(ctx, *first);
             ++first;
         }
         server.complete(ctx);
     } catch (ppstep::session_terminate const& e) {
         ;
+    } catch (ppstep::limit_exceeded const& e) {
+        flush_debug_output();
+        std::cerr << "error: " << e.what();
+        status = 2;
     } catch (boost::wave::cpp_exception const& e) {
+        flush_debug_output();
         std::cerr << e.what() << ": " << e.description() << std::endl;
     } catch (boost::wave::cpplexer::lexing_exception const& e) {
+        flush_debug_output();
         std::cerr << e.what() << ": " << e.description() << std::endl;
+    } catch (...) {
+        // anything else still ends the process, but not before the events leading up to it are out
+        flush_debug_output();
+        throw;
+    }
+    debug_output.reset();
+
+    if (output) output->flush();
+    includes.save();
+
+    if (args.count("source-map")) {
+        auto const& output_file = args["output"].as<std::string>();
+        std::ofstream map_out(output_file + ".map");
+        map.write(map_out, boost::filesystem::path(output_file).filename().string(), origins);
+    }
+
+    if (args.count("expansion-graph")) {
+        auto const& graph_file = args["expansion-graph"].as<std::string>();
+        std::ofstream graph_out(graph_file);
+        if (boost::filesystem::path(graph_file).extension() == ".dot") {
+            graph.write_dot(graph_out);
+        } else {
+            graph.write_json(graph_out);
+        }
+    }
+
+    if (args.count("heatmap")) {
+        auto const& heatmap_file = args["heatmap"].as<std::string>();
+        auto extension = boost::filesystem::path(heatmap_file).extension();
+        std::ofstream heatmap_out(heatmap_file);
+        if (extension == ".csv") {
+            heatmap.write_csv(heatmap_out);
+        } else if (extension == ".json") {
+            heatmap.write_json(heatmap_out);
+        } else {
+            heatmap.write_annotated(heatmap_out);
+        }
     }
 
-    return 0;
+    return status;
 }
\ No newline at end of file
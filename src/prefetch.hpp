@@ -0,0 +1,251 @@
+#ifndef PPSTEP_PREFETCH_HPP
+#define PPSTEP_PREFETCH_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <optional>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <iterator>
+
+#include <boost/filesystem.hpp>
+
+namespace ppstep {
+    // Reads headers on background threads ahead of the preprocessor. Every file read is scanned for
+    // #include lines, which are resolved against the search paths and read in turn, so a header's nested
+    // includes are usually in memory by the time preprocessing reaches them. Includes that only appear under
+    // conditions that are never taken are read for nothing; max_files bounds how much that can cost. Names
+    // computed by macros are not followed: by the time their directive is seen the preprocessor is about to
+    // open the file itself.
+    struct include_prefetcher {
+        static constexpr std::size_t max_files = 4096;
+
+        include_prefetcher(std::size_t thread_count) : stopping(false), requested(0) {
+            for (std::size_t i = 0; i != thread_count; ++i) threads.emplace_back([this]() { work(); });
+        }
+
+        ~include_prefetcher() {
+            {
+                auto lock = std::lock_guard<std::mutex>(mutex);
+                stopping = true;
+            }
+            wake_workers.notify_all();
+            for (auto& thread : threads) thread.join();
+        }
+
+        include_prefetcher(include_prefetcher const&) = delete;
+        include_prefetcher& operator=(include_prefetcher const&) = delete;
+
+        // Call before preprocessing starts; the threads only read the lists afterwards.
+        void add_include_path(std::string const& path) {
+            user_paths.push_back(boost::filesystem::absolute(path));
+        }
+
+        void add_sysinclude_path(std::string const& path) {
+            system_paths.push_back(boost::filesystem::absolute(path));
+        }
+
+        // Reads a file and everything it includes.
+        void prefetch(std::string const& file) {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            enqueue(key(file));
+        }
+
+        // The contents of a file, if it has been read or is being read. A file that nobody has started on yet is
+        // left to the caller, which would otherwise wait behind the rest of the queue; its includes are scanned
+        // when it is handed back through scan().
+        std::optional<std::string> take(std::string const& file) {
+            auto lock = std::unique_lock<std::mutex>(mutex);
+            auto it = files.find(key(file));
+            if (it == files.end()) return std::nullopt;
+
+            auto& entry = it->second;
+            if (entry.state == file_state::queued) {
+                entry.state = file_state::taken;
+                return std::nullopt;
+            }
+            done.wait(lock, [&]() { return entry.state != file_state::reading; });
+
+            if (entry.state != file_state::read) return std::nullopt;
+            entry.state = file_state::taken;
+            return std::move(entry.contents);
+        }
+
+        // Queues the includes of a file the caller read itself. Only the #include lines are picked out here;
+        // finding the files they name is left to the threads.
+        void scan(std::string const& file, std::string const& contents) {
+            auto file_key = key(file);
+            auto current_dir = path_type(file_key).parent_path().string();
+            auto spellings = find_includes(contents);
+
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            files[file_key].state = file_state::taken;
+            for (auto& spelling : spellings) {
+                queue.push_back(task{task_kind::resolve, std::move(spelling), current_dir});
+            }
+            wake_workers.notify_all();
+        }
+
+    private:
+        using path_type = boost::filesystem::path;
+
+        enum class file_state { queued, reading, read, failed, taken };
+
+        struct file_entry {
+            file_state state = file_state::queued;
+            std::string contents;
+        };
+
+        // A file to read, or an include directive to resolve (spelling plus the including directory).
+        enum class task_kind { read, resolve };
+
+        struct task {
+            task_kind kind;
+            std::string file;
+            std::string current_dir;
+        };
+
+        static std::string key(std::string const& file) {
+            return boost::filesystem::absolute(file).lexically_normal().string();
+        }
+
+        // Expects the lock to be held.
+        void enqueue(std::string file) {
+            if (files.count(file) || requested >= max_files) return;
+            ++requested;
+            files.emplace(file, file_entry());
+            queue.push_back(task{task_kind::read, std::move(file), std::string()});
+            wake_workers.notify_one();
+        }
+
+        void work() {
+            for (;;) {
+                auto next = task();
+                {
+                    auto lock = std::unique_lock<std::mutex>(mutex);
+                    wake_workers.wait(lock, [&]() { return stopping || !queue.empty(); });
+                    if (stopping) return;
+
+                    next = std::move(queue.front());
+                    queue.pop_front();
+
+                    if (next.kind == task_kind::resolve) {
+                        lock.unlock();
+                        auto resolved = resolve(next.file, next.current_dir);
+                        if (resolved) {
+                            lock.lock();
+                            enqueue(key(resolved->string()));
+                        }
+                        continue;
+                    }
+
+                    auto it = files.find(next.file);
+                    if (it == files.end() || it->second.state != file_state::queued) continue;
+                    it->second.state = file_state::reading;
+                }
+
+                auto contents = read(next.file);
+                auto current_dir = path_type(next.file).parent_path();
+                auto includes = std::vector<std::string>();
+                if (contents) {
+                    for (auto const& spelling : find_includes(*contents)) {
+                        if (auto resolved = resolve(spelling, current_dir)) includes.push_back(key(resolved->string()));
+                    }
+                }
+
+                auto lock = std::lock_guard<std::mutex>(mutex);
+                auto& entry = files[next.file];
+                if (contents) {
+                    entry.contents = std::move(*contents);
+                    entry.state = file_state::read;
+                } else {
+                    entry.state = file_state::failed;
+                }
+                done.notify_all();
+                for (auto& include : includes) enqueue(std::move(include));
+            }
+        }
+
+        static std::optional<std::string> read(std::string const& file) {
+            std::ifstream in(file, std::ios::binary);
+            if (!in) return std::nullopt;
+            return std::string(std::istreambuf_iterator<char>(in.rdbuf()), std::istreambuf_iterator<char>());
+        }
+
+        // The same search the include cache does, minus the caching: the including directory for quoted names,
+        // then the user paths, then the system paths.
+        std::optional<path_type> resolve(std::string const& spelling, path_type const& current_dir) const {
+            if (spelling.size() < 2) return std::nullopt;
+
+            bool is_system = spelling.front() == '<';
+            if (!is_system && spelling.front() != '"') return std::nullopt;
+
+            auto name = path_type(spelling.substr(1, spelling.size() - 2));
+            boost::system::error_code ec;
+            auto exists = [&](path_type const& candidate) { return boost::filesystem::is_regular_file(candidate, ec); };
+
+            if (name.has_root_directory()) {
+                if (exists(name)) return name;
+                return std::nullopt;
+            }
+
+            if (!is_system) {
+                if (exists(current_dir / name)) return current_dir / name;
+                for (auto const& dir : user_paths) {
+                    if (exists(dir / name)) return dir / name;
+                }
+            }
+            for (auto const& dir : system_paths) {
+                if (exists(dir / name)) return dir / name;
+            }
+            return std::nullopt;
+        }
+
+        // The names on every '#include "..."' and '#include <...>' line, with their delimiters.
+        static std::vector<std::string> find_includes(std::string const& text) {
+            auto found = std::vector<std::string>();
+
+            std::size_t pos = 0;
+            while (pos < text.size()) {
+                auto end = text.find('\n', pos);
+                if (end == std::string::npos) end = text.size();
+
+                auto i = text.find_first_not_of(" \t", pos);
+                if (i < end && text[i] == '#') {
+                    i = text.find_first_not_of(" \t", i + 1);
+                    if (i < end && text.compare(i, 7, "include") == 0) {
+                        i += 7;
+                        if (text.compare(i, 5, "_next") == 0) i += 5;
+                        i = text.find_first_not_of(" \t", i);
+                        if (i < end && (text[i] == '"' || text[i] == '<')) {
+                            auto close = text.find(text[i] == '"' ? '"' : '>', i + 1);
+                            if (close < end) found.push_back(text.substr(i, close + 1 - i));
+                        }
+                    }
+                }
+                pos = end + 1;
+            }
+            return found;
+        }
+
+        std::vector<path_type> user_paths;
+        std::vector<path_type> system_paths;
+
+        std::mutex mutex;
+        std::condition_variable wake_workers;
+        std::condition_variable done;
+        bool stopping;
+
+        std::deque<task> queue;
+        std::unordered_map<std::string, file_entry> files;
+        std::size_t requested;
+
+        std::vector<std::thread> threads;
+    };
+}
+
+#endif // PPSTEP_PREFETCH_HPP
@@ -0,0 +1,53 @@
+#ifndef PPSTEP_PREPROCESSOR_HPP
+#define PPSTEP_PREPROCESSOR_HPP
+
+// The preprocessor configuration shared by ppstep and the benchmarks. Include this before anything else that
+// pulls in Wave, so the macros below are seen by every Wave header.
+
+#define BOOST_WAVE_ENABLE_COMMANDLINE_MACROS 1
+#define BOOST_NO_MEMBER_TEMPLATE_FRIENDS 1
+
+#include <string>
+#include <list>
+
+#include <boost/wave.hpp>
+#include <boost/wave/cpplexer/cpp_lex_token.hpp>
+#include <boost/wave/cpplexer/cpp_lex_iterator.hpp>
+#include <boost/wave/cpplexer/re2clex/cpp_re2c_lexer.hpp>
+
+// the prebuilt Wave library only instantiates these grammars for its own lexer iterator
+#include <boost/wave/grammars/cpp_grammar.hpp>
+#include <boost/wave/grammars/cpp_defined_grammar.hpp>
+#include <boost/wave/grammars/cpp_has_include_grammar.hpp>
+#include <boost/wave/grammars/cpp_predef_macros_grammar.hpp>
+
+#include "client.hpp"
+#include "server.hpp"
+#include "token_cache.hpp"
+
+namespace ppstep {
+    using token_type = boost::wave::cpplexer::lex_token<>;
+
+    using token_sequence_type = std::list<token_type, boost::fast_pool_allocator<token_type>>;
+
+    using lex_iterator_type = cached_lex_iterator<token_type>;
+
+    using context_type =
+        boost::wave::context<
+            std::string::iterator,
+            lex_iterator_type,
+            load_file_cached,
+            server<token_type, token_sequence_type>
+        >;
+
+    inline auto const language = boost::wave::language_support(
+            boost::wave::support_cpp2a
+            | boost::wave::support_option_va_opt
+            | boost::wave::support_option_convert_trigraphs
+            | boost::wave::support_option_long_long
+            | boost::wave::support_option_include_guard_detection
+            | boost::wave::support_option_emit_pragma_directives
+            | boost::wave::support_option_insert_whitespace);
+}
+
+#endif // PPSTEP_PREPROCESSOR_HPP
@@ -0,0 +1,101 @@
+#ifndef PPSTEP_PROGRESS_HPP
+#define PPSTEP_PROGRESS_HPP
+
+#include <csignal>
+#include <chrono>
+#include <string>
+#include <iostream>
+#include <iomanip>
+
+namespace ppstep {
+    namespace detail {
+        inline volatile std::sig_atomic_t interrupt_flag = 0;
+
+        inline void on_interrupt_signal(int) {
+            // a second interrupt before the first was noticed means preprocessing is stuck outside of any event
+            if (interrupt_flag) {
+                std::signal(SIGINT, SIG_DFL);
+                std::raise(SIGINT);
+                return;
+            }
+            interrupt_flag = 1;
+        }
+    }
+
+    // SIGINT asks a running session to stop at the prompt at the next preprocessing event.
+    inline void install_interrupt_handler() {
+        std::signal(SIGINT, detail::on_interrupt_signal);
+    }
+
+    inline bool interrupt_requested() {
+        return detail::interrupt_flag != 0;
+    }
+
+    inline void clear_interrupt() {
+        detail::interrupt_flag = 0;
+    }
+
+    // A status line on stderr for runs that take a while. Counting an event is an increment and a mask test;
+    // the clock is only read every check_interval events, and the line is only redrawn every refresh_interval.
+    struct progress_meter {
+        using clock = std::chrono::steady_clock;
+
+        static constexpr std::size_t check_interval = 1 << 10;
+        static constexpr auto initial_delay = std::chrono::milliseconds(500);
+        static constexpr auto refresh_interval = std::chrono::milliseconds(250);
+        static constexpr std::size_t max_file_width = 60;
+
+        progress_meter() : enabled(false), shown(false), events(0), events_at_last(0), last(clock::now()) {}
+
+        void enable(bool on) {
+            enabled = on;
+        }
+
+        // True when the status line is due for a redraw.
+        bool tick() {
+            if ((++events & (check_interval - 1)) != 0 || !enabled) return false;
+
+            auto now = clock::now();
+            if (now - last < (shown ? refresh_interval : initial_delay)) return false;
+            return true;
+        }
+
+        template <class PositionT>
+        void show(PositionT const& pos, std::size_t depth) {
+            auto now = clock::now();
+            auto seconds = std::chrono::duration<double>(now - last).count();
+            auto rate = seconds > 0 ? static_cast<std::size_t>((events - events_at_last) / seconds) : 0;
+
+            auto file = std::string(pos.get_file().c_str());
+            if (file.size() > max_file_width) file = "..." + file.substr(file.size() - max_file_width + 3);
+
+            std::cerr << "\r\u001b[K" << rate << " events/s, depth " << depth << ", " << file << ':' << pos.get_line() << std::flush;
+
+            shown = true;
+            last = now;
+            events_at_last = events;
+        }
+
+        // Called whenever the user gets control back; the next run starts its own delay and rate.
+        void resume() {
+            last = clock::now();
+            events_at_last = events;
+        }
+
+        // Removes the status line before anything else is printed.
+        void clear() {
+            if (!shown) return;
+            std::cerr << "\r\u001b[K" << std::flush;
+            shown = false;
+        }
+
+    private:
+        bool enabled;
+        bool shown;
+        std::size_t events;
+        std::size_t events_at_last;
+        clock::time_point last;
+    };
+}
+
+#endif // PPSTEP_PROGRESS_HPP
@@ -0,0 +1,217 @@
+#ifndef PPSTEP_PROTOCOL_HPP
+#define PPSTEP_PROTOCOL_HPP
+
+#include <string>
+#include <string_view>
+#include <optional>
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+namespace ppstep {
+    // Minimal streaming JSON writer. Keys and values are appended in order, and separators are inserted
+    // automatically, so callers only need to balance begin/end calls.
+    struct json_writer {
+        json_writer() : need_separator(false) {}
+
+        json_writer& begin_object() {
+            separate();
+            buffer += '{';
+            need_separator = false;
+            return *this;
+        }
+
+        json_writer& end_object() {
+            buffer += '}';
+            need_separator = true;
+            return *this;
+        }
+
+        json_writer& begin_array() {
+            separate();
+            buffer += '[';
+            need_separator = false;
+            return *this;
+        }
+
+        json_writer& end_array() {
+            buffer += ']';
+            need_separator = true;
+            return *this;
+        }
+
+        json_writer& key(std::string_view name) {
+            separate();
+            write_string(name);
+            buffer += ':';
+            need_separator = false;
+            return *this;
+        }
+
+        json_writer& value(std::string_view str) {
+            separate();
+            write_string(str);
+            need_separator = true;
+            return *this;
+        }
+
+        json_writer& value(char const* str) {
+            return value(std::string_view(str));
+        }
+
+        json_writer& value(std::size_t number) {
+            separate();
+            buffer += std::to_string(number);
+            need_separator = true;
+            return *this;
+        }
+
+        json_writer& value(bool b) {
+            separate();
+            buffer += b ? "true" : "false";
+            need_separator = true;
+            return *this;
+        }
+
+        json_writer& raw(std::string_view json) {
+            separate();
+            buffer += json;
+            need_separator = true;
+            return *this;
+        }
+
+        template <class Iterator>
+        json_writer& tokens(Iterator it, Iterator end) {
+            begin_array();
+            for (; it != end; ++it) {
+                value(std::string_view(it->get_value().c_str(), it->get_value().size()));
+            }
+            return end_array();
+        }
+
+        template <class Container>
+        json_writer& tokens(Container const& data) {
+            return tokens(std::begin(data), std::end(data));
+        }
+
+        template <class PositionT>
+        json_writer& position(PositionT const& pos) {
+            begin_object();
+            key("file").value(std::string_view(pos.get_file().c_str(), pos.get_file().size()));
+            key("line").value(std::size_t(pos.get_line()));
+            key("column").value(std::size_t(pos.get_column()));
+            return end_object();
+        }
+
+        std::string buffer;
+
+    private:
+        void separate() {
+            if (need_separator) buffer += ',';
+        }
+
+        void write_string(std::string_view str) {
+            buffer += '"';
+            for (char c : str) {
+                switch (c) {
+                    case '"': buffer += "\\\""; break;
+                    case '\\': buffer += "\\\\"; break;
+                    case '\n': buffer += "\\n"; break;
+                    case '\r': buffer += "\\r"; break;
+                    case '\t': buffer += "\\t"; break;
+                    default: {
+                        if (static_cast<unsigned char>(c) < 0x20) {
+                            char escaped[8];
+                            std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                            buffer += escaped;
+                        } else {
+                            buffer += c;
+                        }
+                    }
+                }
+            }
+            buffer += '"';
+        }
+
+        bool need_separator;
+    };
+
+    struct protocol_request {
+        std::optional<std::string> id;
+        std::string command;
+    };
+
+    // Newline-delimited JSON over a pair of streams. Every message written is a single JSON object on its own
+    // line; events are accumulated and sent in batches so that long runs cost one write per batch.
+    struct protocol_channel {
+        static constexpr std::size_t version = 1;
+
+        protocol_channel(std::istream& in, std::streambuf* out, std::size_t batch_limit = 4096)
+            : in(in), out(out), batch_limit(batch_limit), batched(0) {}
+
+        void send(std::string const& message) {
+            flush_events();
+            out << message << '\n' << std::flush;
+        }
+
+        void add_event(std::string const& event) {
+            if (batched == 0) {
+                batch.clear();
+                batch += "{\"type\":\"events\",\"events\":[";
+            } else {
+                batch += ',';
+            }
+            batch += event;
+
+            if (++batched >= batch_limit) flush_events();
+        }
+
+        void flush_events() {
+            if (batched == 0) return;
+
+            batch += "]}\n";
+            out << batch << std::flush;
+            batched = 0;
+        }
+
+        // Reads the next well-formed request, answering malformed ones with an error message. Returns
+        // nothing once input is exhausted.
+        std::optional<protocol_request> receive() {
+            for (std::string line; std::getline(in, line);) {
+                if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+
+                try {
+                    boost::property_tree::ptree tree;
+                    std::istringstream ss(line);
+                    boost::property_tree::read_json(ss, tree);
+
+                    auto request = protocol_request();
+                    if (auto id = tree.get_optional<std::string>("id")) request.id = *id;
+                    request.command = tree.get<std::string>("command");
+                    return request;
+                } catch (std::exception const& e) {
+                    auto error = json_writer();
+                    error.begin_object()
+                        .key("type").value("error")
+                        .key("message").value(e.what())
+                        .end_object();
+                    send(error.buffer);
+                }
+            }
+            return {};
+        }
+
+    private:
+        std::istream& in;
+        std::ostream out;
+
+        std::size_t batch_limit;
+        std::size_t batched;
+        std::string batch;
+    };
+}
+
+#endif // PPSTEP_PROTOCOL_HPP
@@ -2,24 +2,76 @@
 #define PPSTEP_SERVER_HPP
 
 #include <vector>
+#include <array>
+#include <memory>
+#include <set>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/wave/util/filesystem_compatibility.hpp>
 
 #include "server_fwd.hpp"
 #include "client.hpp"
+#include "include_cache.hpp"
+#include "token_cache.hpp"
+#include "macro_index.hpp"
+#include "expansion_graph.hpp"
+#include "watchdog.hpp"
+#include "progress.hpp"
+#include "hook_timings.hpp"
+#include "heatmap.hpp"
+#include "macro_profile.hpp"
+#include "source_map.hpp"
+#include "prefetch.hpp"
+#include "event_feed.hpp"
 
 namespace ppstep {
     template <class ContainerT>
     struct server_state {
-        server_state() : expanding(), rescanning() {}
+        using string_type = typename ContainerT::value_type::string_type;
+
+        server_state() : expanding(), rescanning(), macros(std::make_shared<macro_index>()), scope_active(0), trace_system_headers(true), feed(nullptr) {}
+
+        // An empty trace scope traces everything; otherwise only expansions nested inside a call to one of
+        // the scoped macros (from its call until it has been rescanned) are reported to the client.
+        bool tracing() const {
+            return (trace_scope.empty() || scope_active != 0) && (trace_system_headers || !in_system_header());
+        }
+
+        // Headers included with angle brackets, and everything they include in turn.
+        bool in_system_header() const {
+            return !system_frames.empty() && system_frames.back();
+        }
 
         std::vector<ContainerT> expanding;
         std::vector<std::pair<ContainerT, ContainerT>> rescanning;
+        std::shared_ptr<macro_index> macros;
+
+        std::set<string_type> trace_scope;
+        std::vector<bool> scope_frames;
+        std::size_t scope_active;
+
+        bool trace_system_headers;
+        std::vector<bool> system_frames;
+
+        expansion_watchdog watchdog;
+        progress_meter progress;
+
+        // Shared with the client, which publishes a backtrace whenever it stops at the prompt.
+        event_publisher* feed;
     };
 
     template <typename TokenT, typename ContainerT>
     struct server : boost::wave::context_policies::eat_whitespace<TokenT> {
         using base_type = boost::wave::context_policies::eat_whitespace<TokenT>;
 
-        server(server_state<ContainerT>& state, client<TokenT, ContainerT>& sink, bool debug = false) : state(&state), sink(&sink), debug(debug), evaluating_conditional(false)  {}
+        server(server_state<ContainerT>& state, client<TokenT, ContainerT>& sink, bool debug = false)
+            : state(&state), sink(&sink), debug(debug), includes(nullptr), tokens(nullptr), graph(nullptr), heatmap(nullptr), profile(nullptr), origins(nullptr), prefetch(nullptr), evaluating_conditional(false)  {}
+
+        // Without a client nothing is traced; preprocessing runs straight through for the collaborators only.
+        explicit server(server_state<ContainerT>& state)
+            : state(&state), sink(nullptr), debug(false), includes(nullptr), tokens(nullptr), graph(nullptr), heatmap(nullptr), profile(nullptr), origins(nullptr), prefetch(nullptr), evaluating_conditional(false)  {}
 
         ~server() {}
 
@@ -46,11 +98,18 @@ namespace ppstep {
                 ContainerT const& definition,
                 TokenT const& macrocall, std::vector<ContainerT> const& arguments,
                 IteratorT const& seqstart, IteratorT const& seqend) {
-            if (evaluating_conditional) return false;
+            PPSTEP_TIME_HOOK(expanding_function_like_macro);
+            if (heatmap) heatmap->charge(ctx.get_main_pos(), source_heatmap::cost_kind::call);
 
-            auto sanitized_arguments = std::vector<ContainerT>();
-            for (auto const& arg_container : arguments) {
-                sanitized_arguments.push_back(sanitize(arg_container));
+            if (evaluating_conditional) return false;
+            if (profile) profile->called(macrocall);
+            if (origins) origins->called(macrocall, definition);
+
+            bool tracing = enter_scope(macrocall);
+            if (!tracing && !graph && !state->feed) {
+                state->expanding.push_back({macrocall});
+                check_call_limits(ctx, macrocall);
+                return false;
             }
 
             auto full_call = ContainerT(seqstart, seqend);
@@ -59,15 +118,25 @@ namespace ppstep {
                 full_call.push_back(*seqend);
                 full_call = sanitize(full_call);
             }
+
+            if (state->feed) state->feed->called(depth(), macrocall, full_call);
             
-            if (!debug) {
+            if (tracing && !debug) {
+                auto sanitized_arguments = std::vector<ContainerT>();
+                for (auto const& arg_container : arguments) {
+                    sanitized_arguments.push_back(sanitize(arg_container));
+                }
+
                 sink->on_expand_function(ctx, macrodef, sanitized_arguments, full_call);
-            } else {
+            } else if (tracing) {
                 std::cout << "F: ";
-                print_token_container(std::cout, full_call) << std::endl;
+                print_token_container(std::cout, full_call) << '\n';
             }
 
+            if (graph) graph->called(full_call);
+
             state->expanding.push_back(full_call);
+            check_call_limits(ctx, macrocall);
 
             return false;
         }
@@ -76,57 +145,104 @@ namespace ppstep {
         bool expanding_object_like_macro(
                 ContextT& ctx, TokenT const& macrodef,
                 ContainerT const& definition, TokenT const& macrocall) {
+            PPSTEP_TIME_HOOK(expanding_object_like_macro);
+            if (heatmap) heatmap->charge(ctx.get_main_pos(), source_heatmap::cost_kind::call);
+
             if (evaluating_conditional) return false;
+            if (profile) profile->called(macrocall);
+            if (origins) origins->called(macrocall, definition);
+
+            bool tracing = enter_scope(macrocall);
+
+            if (state->feed) state->feed->called(depth(), macrocall, std::array<TokenT, 1>{macrocall});
             
-            if (!debug) {
+            if (tracing && !debug) {
                 sink->on_expand_object(ctx, macrocall);
-            } else {
+            } else if (tracing) {
                 std::cout << "O: ";
-                print_token(std::cout, macrocall) << std::endl;
+                print_token(std::cout, macrocall) << '\n';
             }
 
+            if (graph) graph->called(ContainerT{macrocall});
+
             state->expanding.push_back({macrocall});
+            check_call_limits(ctx, macrocall);
             return false;
         }
 
         template <typename ContextT>
         void expanded_macro(ContextT& ctx, ContainerT const& result) {
+            PPSTEP_TIME_HOOK(expanded_macro);
+            if (heatmap) heatmap->charge(ctx.get_main_pos(), source_heatmap::cost_kind::expansion);
+
             if (evaluating_conditional) return;
+            if (profile) profile->expanded(std::count_if(result.begin(), result.end(), [this](auto const& token) { return !should_skip_token(token); }));
+            if (origins) origins->expanded(result);
+
+            auto& initial = *(state->expanding.rbegin());
 
-            auto const& initial = *(state->expanding.rbegin());
+            bool tracing = this->tracing();
+            if (tracing || graph || state->feed) {
+                auto sanitized_result = sanitize(result);
+                if (state->feed) state->feed->expanded(depth() - 1, initial.front(), sanitized_result);
             
-            if (!debug) {
-                 sink->on_expanded(ctx, sanitize(initial), sanitize(result));
-            } else {
-                std::cout << "E: ";
-                print_token_container(std::cout, sanitize(initial)) << " -> ";
-                print_token_container(std::cout, sanitize(result)) << std::endl;
+                if (tracing && !debug) {
+                    sink->on_expanded(ctx, sanitize(initial), sanitized_result);
+                } else if (tracing) {
+                    std::cout << "E: ";
+                    print_token_container(std::cout, sanitize(initial)) << " -> ";
+                    print_token_container(std::cout, sanitized_result) << '\n';
+                }
+
+                if (graph) graph->expanded(sanitized_result);
             }
 
-            state->rescanning.push_back({initial, result});
+            state->rescanning.push_back({std::move(initial), result});
 
             state->expanding.pop_back();
+
+            check_result_limits(ctx, "expansion", state->rescanning.back().first.front(), result, depth());
         }
 
         template <typename ContextT>
         void rescanned_macro(ContextT& ctx, ContainerT const& result) {
-            if (evaluating_conditional) return;
+            PPSTEP_TIME_HOOK(rescanned_macro);
+            if (heatmap) heatmap->charge(ctx.get_main_pos(), source_heatmap::cost_kind::rescan);
 
-            auto const& [cause, initial] = *(state->rescanning.rbegin());
+            if (evaluating_conditional) return;
+            if (profile) profile->rescanned();
+            if (origins) origins->rescanned();
+
+            bool tracing = this->tracing();
+            if (tracing || graph || state->feed) {
+                auto const& [cause, initial] = *(state->rescanning.rbegin());
+                auto sanitized_result = sanitize(result);
+                if (state->feed) state->feed->rescanned(depth() - 1, cause.front(), sanitized_result);
+
+                if (tracing && !debug) {
+                    sink->on_rescanned(ctx, sanitize(cause), sanitize(initial), sanitized_result);
+                } else if (tracing) {
+                    std::cout << "R: ";
+                    print_token_container(std::cout, sanitize(initial)) << " -> ";
+                    print_token_container(std::cout, sanitized_result) << '\n';
+                }
 
-            if (!debug) {
-                sink->on_rescanned(ctx, sanitize(cause), sanitize(initial), sanitize(result));
-            } else {
-                std::cout << "R: ";
-                print_token_container(std::cout, sanitize(initial)) << " -> ";
-                print_token_container(std::cout, sanitize(result)) << std::endl;
+                if (graph) graph->rescanned(sanitized_result);
             }
 
+            auto macro = state->rescanning.back().first.front();
             state->rescanning.pop_back();
+
+            leave_scope();
+
+            check_result_limits(ctx, "rescan", macro, result, depth() + 1);
         }
         
         template <typename ContextT>
         bool found_directive(ContextT const& ctx, TokenT const& directive) {
+            // headers full of definitions can take a long time without a single event
+            if (state->progress.tick()) show_progress(ctx);
+
             auto directive_id = boost::wave::token_id(directive);
             switch (directive_id) {
                 case boost::wave::T_PP_IF:
@@ -148,53 +264,190 @@ namespace ppstep {
 
             return false;
         }
-        
+
+
+        template <typename ContextT>
+        bool locate_include_file(ContextT& ctx, std::string& file_path, bool is_system, char const* current_name,
+                                 std::string& dir_path, std::string& native_name) {
+            if (!includes || current_name) {
+                return base_type::locate_include_file(ctx, file_path, is_system, current_name, dir_path, native_name);
+            }
+
+            auto current_rel_dir = boost::wave::util::branch_path(boost::wave::util::create_path(ctx.get_current_relative_filename()));
+            if (!includes->find_include_file(file_path, dir_path, is_system, ctx.get_current_directory(), current_rel_dir)) {
+                return false;
+            }
+
+            native_name = boost::wave::util::native_file_string(boost::wave::util::create_path(file_path));
+            return true;
+        }
+
+        template <typename ContextT>
+        void opened_include_file(ContextT const& ctx, std::string const& relname, std::string const& absname, bool is_system_include) {
+            if (heatmap) heatmap->enter_include(ctx.get_main_pos());
+            state->system_frames.push_back(is_system_include || state->in_system_header());
+        }
+
+        template <typename ContextT>
+        void returning_from_include_file(ContextT const& ctx) {
+            if (heatmap) heatmap->leave_include();
+            if (!state->system_frames.empty()) state->system_frames.pop_back();
+        }
+
         template <typename ContextT, typename ParametersT, typename DefinitionT>
         void defined_macro(ContextT const& ctx, TokenT const& macro_name, bool is_functionlike, ParametersT const& parameters,
                            DefinitionT const& definition, bool is_predefined) {
-            
+            state->macros->define(macro_name, is_functionlike, parameters, definition, is_predefined);
         }
         
         template <typename ContextT>
         void undefined_macro(ContextT const& ctx, TokenT const& macro_name) {
-            
+            state->macros->undefine(macro_name);
         }
 
         template <typename ContextT>
         void lexed_token(ContextT& ctx, TokenT const& result) {
+            PPSTEP_TIME_HOOK(lexed_token);
+
             if (should_skip_token(result)) return;
 
+            if (heatmap) heatmap->charge(ctx.get_main_pos(), source_heatmap::cost_kind::token);
+            enforce_limit(ctx, count_event(ctx), std::string("at token ") + result.get_value().c_str());
+
+            if (!tracing()) return;
+
             if (!debug) {
                 sink->on_lexed(ctx, result);
             } else {
                 std::cout << "L: ";
-                print_token(std::cout, result) << std::endl;
+                print_token(std::cout, result) << '\n';
             }
         }
         
         template <typename ContextT, typename ExceptionT>
         void throw_exception(ContextT& ctx, ExceptionT const& e) {
-            sink->on_exception(ctx, e);
+            if (sink) sink->on_exception(ctx, e);
             boost::throw_exception(e);
         }
 
         template <typename ContextT>
         void start(ContextT& ctx) {
-            if (debug) return;
+            if (debug || !sink) return;
 
             sink->on_start(ctx);
         }
 
         template <typename ContextT>
         void complete(ContextT& ctx) {
-            if (debug) return;
+            if (debug || !sink) return;
 
             sink->on_complete(ctx);
         }
 
+        template <typename ContextT>
+        void check_call_limits(ContextT& ctx, TokenT const& macrocall) {
+            auto where = std::string("in call to ") + macrocall.get_value().c_str();
+            enforce_limit(ctx, state->watchdog.on_depth(depth()), where);
+            enforce_limit(ctx, count_event(ctx), where);
+        }
+
+        template <typename ContextT>
+        void check_result_limits(ContextT& ctx, char const* stage, TokenT const& macro, ContainerT const& result, std::size_t frame_depth) {
+            auto where = [&]() {
+                return std::string("in ") + stage + " of " + macro.get_value().c_str();
+            };
+
+            // whitespace only inflates the raw size, so the exact count is only needed past the limit
+            auto const max_tokens = state->watchdog.limits.tokens;
+            if (max_tokens && result.size() > max_tokens) {
+                auto significant = std::count_if(result.begin(), result.end(), [this](auto const& token) { return !should_skip_token(token); });
+                enforce_limit(ctx, state->watchdog.on_result(significant, frame_depth), where());
+            }
+
+            if (auto violation = count_event(ctx)) {
+                enforce_limit(ctx, violation, where());
+            }
+        }
+
+        // Every event passes through here, traced or not. Traced events are interrupted by the client, which
+        // knows what it is stopping at; outside the trace scope the server has to stop on its own.
+        template <typename ContextT>
+        std::optional<std::string> count_event(ContextT& ctx) {
+            if (state->progress.tick()) show_progress(ctx);
+            if (interrupt_requested() && sink && !debug && !tracing()) {
+                clear_interrupt();
+                sink->on_interrupt(ctx);
+            }
+            return state->watchdog.on_event();
+        }
+
+        template <typename ContextT>
+        void show_progress(ContextT const& ctx) {
+            state->progress.show(ctx.get_main_pos(), state->expanding.size() + state->rescanning.size());
+        }
+
+        template <typename ContextT>
+        void enforce_limit(ContextT& ctx, std::optional<std::string> const& violation, std::string const& where) {
+            if (!violation) return;
+
+            auto message = *violation + ' ' + where;
+            if (sink && !debug) {
+                sink->on_limit(ctx, message);
+                return;
+            }
+
+            std::ostringstream report;
+            report << message << "\nbacktrace:\n";
+            std::size_t idx = 0;
+            for (auto it = state->expanding.rbegin(); it != state->expanding.rend(); ++it, ++idx) {
+                report << idx << ": ";
+                print_token_container(report, sanitize(*it)) << '\n';
+            }
+            for (auto it = state->rescanning.rbegin(); it != state->rescanning.rend(); ++it, ++idx) {
+                report << idx << ": ";
+                print_token_container(report, sanitize(it->first)) << " (rescanning)\n";
+            }
+            throw limit_exceeded(report.str());
+        }
+
+        // Scope bookkeeping runs for every expansion, traced or not: one flag per open expansion, from its
+        // call until it has been rescanned.
+        bool enter_scope(TokenT const& macrocall) {
+            bool entering = !state->trace_scope.empty()
+                    && state->trace_scope.find(macrocall.get_value()) != state->trace_scope.end();
+            state->scope_frames.push_back(entering);
+
+            if (entering && state->scope_active++ == 0 && sink && !debug) {
+                sink->on_scope_entered();
+            }
+            return tracing();
+        }
+
+        bool tracing() const {
+            return sink && state->tracing();
+        }
+
+        std::size_t depth() const {
+            return state->expanding.size() + state->rescanning.size();
+        }
+
+        void leave_scope() {
+            if (state->scope_frames.empty()) return;
+
+            if (state->scope_frames.back()) --state->scope_active;
+            state->scope_frames.pop_back();
+        }
+
         server_state<ContainerT>* state;
         client<TokenT, ContainerT>* sink;
         bool debug;
+        include_cache* includes;
+        token_cache* tokens;
+        expansion_graph* graph;
+        source_heatmap* heatmap;
+        macro_profile* profile;
+        expansion_origins* origins;
+        include_prefetcher* prefetch;
 
         unsigned int conditional_nesting;
         bool evaluating_conditional;
@@ -0,0 +1,243 @@
+#ifndef PPSTEP_SOURCE_MAP_HPP
+#define PPSTEP_SOURCE_MAP_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <ostream>
+
+#include "protocol.hpp"
+
+namespace ppstep {
+    // Base64 VLQ, as used by JavaScript source maps.
+    inline void append_vlq(std::string& out, std::int64_t value) {
+        static constexpr char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        auto bits = static_cast<std::uint64_t>(value < 0 ? ((-value) << 1) | 1 : value << 1);
+        do {
+            auto digit = bits & 0x1f;
+            bits >>= 5;
+            if (bits) digit |= 0x20;
+            out += digits[digit];
+        } while (bits);
+    }
+
+    // Files and macro names, numbered in order of first use.
+    struct name_table {
+        std::uint32_t intern(char const* name) {
+            if (last && std::strcmp(last->c_str(), name) == 0) return last_id;
+
+            auto [it, inserted] = ids.emplace(name, static_cast<std::uint32_t>(names.size()));
+            if (inserted) names.push_back(&(it->first));
+            last = &(it->first);
+            last_id = it->second;
+            return last_id;
+        }
+
+        std::vector<std::string const*> names;
+
+    private:
+        std::unordered_map<std::string, std::uint32_t> ids;
+        std::string const* last = nullptr;
+        std::uint32_t last_id = 0;
+    };
+
+    // Tracks which chain of macro expansions produced each token of the preprocessed output. Every token
+    // keeps the position it was lexed at, so a token that came out of a macro's replacement list still
+    // points into that macro's definition; the expansion it was instantiated by is remembered under that
+    // position until the token is written out.
+    struct expansion_origins {
+        static constexpr std::uint32_t none = ~std::uint32_t(0);
+
+        struct node {
+            std::uint32_t parent;
+            std::uint32_t name;
+            std::uint32_t file;
+            std::size_t line, column;
+        };
+
+        template <class TokenT, class ContainerT>
+        void called(TokenT const& macrocall, ContainerT const& definition) {
+            // everything left over from the previous top-level expansion has been written out or dropped
+            if (open.empty()) pending.clear();
+
+            // a macro name that is expanded never reaches the output
+            take(macrocall.get_position());
+
+            auto const& pos = macrocall.get_position();
+            auto parent = open.empty() ? none : open.back().chain;
+            auto key = std::make_tuple(parent, macros.intern(macrocall.get_value().c_str()), files.intern(pos.get_file().c_str()),
+                                       std::size_t(pos.get_line()), std::size_t(pos.get_column()));
+            auto [it, inserted] = chain_ids.emplace(key, static_cast<std::uint32_t>(nodes.size()));
+            if (inserted) nodes.push_back({std::get<0>(key), std::get<1>(key), std::get<2>(key), std::get<3>(key), std::get<4>(key)});
+
+            auto frame = open_frame{it->second, {}};
+            for (auto const& token : definition) frame.body.insert(position_key(token.get_position()));
+            open.push_back(std::move(frame));
+        }
+
+        template <class ContainerT>
+        void expanded(ContainerT const& result) {
+            if (open.empty()) return;
+
+            auto const& frame = open.back();
+            for (auto const& token : result) {
+                auto key = position_key(token.get_position());
+                if (frame.body.count(key)) pending[key].push_back(frame.chain);
+            }
+        }
+
+        void rescanned() {
+            if (!open.empty()) open.pop_back();
+        }
+
+        // The expansion chain of an output token, innermost expansion first, or none for source text.
+        template <class PositionT>
+        std::uint32_t origin_of(PositionT const& pos) {
+            return take(pos);
+        }
+
+        std::vector<node> nodes;
+        name_table files;
+        name_table macros;
+
+    private:
+        struct open_frame {
+            std::uint32_t chain;
+            std::unordered_set<std::uint64_t> body;
+        };
+
+        template <class PositionT>
+        std::uint64_t position_key(PositionT const& pos) {
+            return (std::uint64_t(files.intern(pos.get_file().c_str())) << 48)
+                 | (std::uint64_t(pos.get_line() & 0xffffffff) << 16)
+                 | std::uint64_t(pos.get_column() & 0xffff);
+        }
+
+        template <class PositionT>
+        std::uint32_t take(PositionT const& pos) {
+            if (pending.empty()) return none;
+
+            auto it = pending.find(position_key(pos));
+            if (it == pending.end()) return none;
+
+            auto chain = it->second.front();
+            it->second.pop_front();
+            if (it->second.empty()) pending.erase(it);
+            return chain;
+        }
+
+        std::vector<open_frame> open;
+        std::unordered_map<std::uint64_t, std::deque<std::uint32_t>> pending;
+        std::map<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t, std::size_t, std::size_t>, std::uint32_t> chain_ids;
+    };
+
+    // Maps every token of the preprocessed output back to where it was lexed, in the source map v3 format.
+    // The expansion chains ride along in two extension fields: x_ppstep_expansions lists the chain nodes
+    // (parent + 1, macro name, and the file, line and column of the call, each relative to the previous node)
+    // and x_ppstep_origins holds one value per mapping segment, laid out like mappings, with the chain node + 1
+    // (0 for none) relative to the previous segment's.
+    struct source_map {
+        struct segment {
+            std::size_t column;
+            std::uint32_t file;
+            std::size_t line, source_column;
+            std::uint32_t chain;
+        };
+
+        // Lines and columns of the output count from zero.
+        template <class TokenT>
+        void add(std::size_t output_line, std::size_t output_column, TokenT const& token, expansion_origins& origins) {
+            auto const& pos = token.get_position();
+            if (output_line >= lines.size()) lines.resize(output_line + 1);
+            lines[output_line].push_back({output_column, origins.files.intern(pos.get_file().c_str()), pos.get_line(), pos.get_column(),
+                                          origins.origin_of(pos)});
+        }
+
+        void write(std::ostream& os, std::string const& output_file, expansion_origins const& origins) const {
+            auto mappings = std::string();
+            auto chains = std::string();
+            std::int64_t file = 0, line = 0, column = 0, name = 0, chain = 0;
+            for (std::size_t i = 0; i != lines.size(); ++i) {
+                if (i) {
+                    mappings += ';';
+                    chains += ';';
+                }
+
+                std::int64_t output_column = 0;
+                for (std::size_t j = 0; j != lines[i].size(); ++j) {
+                    auto const& s = lines[i][j];
+                    if (j) {
+                        mappings += ',';
+                        chains += ',';
+                    }
+
+                    // source maps count lines and columns from zero, Wave from one
+                    auto source_line = std::int64_t(s.line ? s.line - 1 : 0);
+                    auto source_column = std::int64_t(s.source_column ? s.source_column - 1 : 0);
+                    append_vlq(mappings, std::int64_t(s.column) - output_column);
+                    append_vlq(mappings, std::int64_t(s.file) - file);
+                    append_vlq(mappings, source_line - line);
+                    append_vlq(mappings, source_column - column);
+                    output_column = s.column;
+                    file = s.file;
+                    line = source_line;
+                    column = source_column;
+
+                    if (s.chain != expansion_origins::none) {
+                        auto macro = std::int64_t(origins.nodes[s.chain].name);
+                        append_vlq(mappings, macro - name);
+                        name = macro;
+                    }
+
+                    auto id = s.chain == expansion_origins::none ? 0 : std::int64_t(s.chain) + 1;
+                    append_vlq(chains, id - chain);
+                    chain = id;
+                }
+            }
+
+            auto expansions = std::string();
+            std::int64_t parent = 0, macro = 0, call_file = 0, call_line = 0, call_column = 0;
+            for (std::size_t i = 0; i != origins.nodes.size(); ++i) {
+                auto const& n = origins.nodes[i];
+                if (i) expansions += ',';
+
+                auto fields = {
+                    std::make_pair(n.parent == expansion_origins::none ? 0 : std::int64_t(n.parent) + 1, &parent),
+                    std::make_pair(std::int64_t(n.name), &macro),
+                    std::make_pair(std::int64_t(n.file), &call_file),
+                    std::make_pair(std::int64_t(n.line ? n.line - 1 : 0), &call_line),
+                    std::make_pair(std::int64_t(n.column ? n.column - 1 : 0), &call_column)};
+                for (auto [value, previous] : fields) {
+                    append_vlq(expansions, value - *previous);
+                    *previous = value;
+                }
+            }
+
+            auto w = json_writer();
+            w.begin_object()
+                .key("version").value(std::size_t(3))
+                .key("file").value(output_file)
+                .key("sources").begin_array();
+            for (auto const* source : origins.files.names) w.value(*source);
+            w.end_array().key("names").begin_array();
+            for (auto const* macro_name : origins.macros.names) w.value(*macro_name);
+            w.end_array()
+                .key("mappings").value(mappings)
+                .key("x_ppstep_expansions").value(expansions)
+                .key("x_ppstep_origins").value(chains)
+                .end_object();
+            os << w.buffer << '\n';
+        }
+
+    private:
+        std::vector<std::vector<segment>> lines;
+    };
+}
+
+#endif // PPSTEP_SOURCE_MAP_HPP
@@ -0,0 +1,155 @@
+#ifndef PPSTEP_TOKEN_AUTOMATON_HPP
+#define PPSTEP_TOKEN_AUTOMATON_HPP
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <deque>
+#include <optional>
+#include <unordered_map>
+
+namespace ppstep {
+    // Aho-Corasick automaton over interned token ids. Patterns can be added and removed at any time; the
+    // automaton is rebuilt on the next use after a change. Feeding a token costs amortized O(1) regardless of
+    // how many patterns there are, and state survives between calls so input can be matched as it streams in.
+    struct token_automaton {
+        using state_type = std::uint32_t;
+        using pattern_type = std::vector<std::uint32_t>;
+
+        static constexpr state_type root = 0;
+
+        token_automaton() : next_id(1), dirty(false), built_generation(0) {}
+
+        std::size_t add(pattern_type pattern) {
+            auto id = next_id++;
+            patterns.emplace(id, std::move(pattern));
+            dirty = true;
+            return id;
+        }
+
+        bool remove(std::size_t id) {
+            if (!patterns.erase(id)) return false;
+            dirty = true;
+            return true;
+        }
+
+        bool empty() const {
+            return patterns.empty();
+        }
+
+        std::map<std::size_t, pattern_type> const& get_patterns() const {
+            return patterns;
+        }
+
+        // Streaming states handed out before a rebuild refer to the old automaton; this changes whenever
+        // they have to be reset to the root.
+        std::size_t generation() {
+            build();
+            return built_generation;
+        }
+
+        state_type step(state_type state, std::uint32_t token) {
+            build();
+
+            while (true) {
+                auto const& edges = nodes[state].edges;
+                auto it = edges.find(token);
+                if (it != edges.end()) return it->second;
+                if (state == root) return root;
+                state = nodes[state].fail;
+            }
+        }
+
+        // The lowest-numbered pattern that ends at the given state, if any.
+        std::optional<std::size_t> match(state_type state) const {
+            auto const& node = nodes[state];
+            if (node.output == no_output) return {};
+            return nodes[node.output].pattern;
+        }
+
+        // Matches a complete sequence from the root, stopping at the first pattern found.
+        template <class Container>
+        std::optional<std::size_t> scan(Container const& tokens) {
+            auto state = root;
+            for (auto const& token : tokens) {
+                state = step(state, token.value);
+                if (auto hit = match(state)) return hit;
+            }
+            return {};
+        }
+
+    private:
+        static constexpr state_type no_output = ~state_type(0);
+
+        struct node {
+            std::unordered_map<std::uint32_t, state_type> edges;
+            state_type fail = root;
+            state_type output = no_output; // nearest node on the failure chain, itself included, ending a pattern
+            std::size_t pattern = 0;
+        };
+
+        void build() {
+            if (!dirty && !nodes.empty()) return;
+            dirty = false;
+            ++built_generation;
+
+            nodes.assign(1, node());
+            for (auto const& [id, pattern] : patterns) {
+                auto state = root;
+                for (auto token : pattern) {
+                    auto it = nodes[state].edges.find(token);
+                    if (it == nodes[state].edges.end()) {
+                        auto child = static_cast<state_type>(nodes.size());
+                        nodes[state].edges.emplace(token, child);
+                        nodes.emplace_back();
+                        state = child;
+                    } else {
+                        state = it->second;
+                    }
+                }
+                if (state != root && nodes[state].output == no_output) {
+                    nodes[state].output = state;
+                    nodes[state].pattern = id;
+                }
+            }
+
+            // breadth-first, so that every failure target is finished before the nodes that depend on it
+            auto queue = std::deque<state_type>();
+            for (auto const& [token, child] : nodes[root].edges) queue.push_back(child);
+            while (!queue.empty()) {
+                auto state = queue.front();
+                queue.pop_front();
+
+                for (auto const& [token, child] : nodes[state].edges) {
+                    auto fail = nodes[state].fail;
+                    while (true) {
+                        auto it = nodes[fail].edges.find(token);
+                        if (it != nodes[fail].edges.end()) {
+                            fail = it->second;
+                            break;
+                        }
+                        if (fail == root) break;
+                        fail = nodes[fail].fail;
+                    }
+                    nodes[child].fail = fail;
+
+                    auto inherited = nodes[fail].output;
+                    if (inherited != no_output && (nodes[child].output == no_output
+                            || nodes[inherited].pattern < nodes[nodes[child].output].pattern)) {
+                        nodes[child].output = inherited;
+                    }
+                    queue.push_back(child);
+                }
+            }
+        }
+
+        std::map<std::size_t, pattern_type> patterns;
+        std::size_t next_id;
+
+        std::vector<node> nodes;
+        bool dirty;
+        std::size_t built_generation;
+    };
+}
+
+#endif // PPSTEP_TOKEN_AUTOMATON_HPP
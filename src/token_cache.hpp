@@ -0,0 +1,360 @@
+#ifndef PPSTEP_TOKEN_CACHE_HPP
+#define PPSTEP_TOKEN_CACHE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <optional>
+#include <unordered_map>
+
+#include <boost/filesystem.hpp>
+#include <boost/iterator/iterator_facade.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/wave/language_support.hpp>
+#include <boost/wave/cpp_exceptions.hpp>
+#include <boost/wave/cpp_throw.hpp>
+#include <boost/wave/cpplexer/cpp_lex_iterator.hpp>
+
+namespace ppstep {
+    template <class TokenT>
+    struct token_stream {
+        std::vector<TokenT> tokens;
+        bool has_guard = false;
+        std::string guard;
+    };
+
+    // Lexed token streams of included files, cached on disk in a directory with one file per header. Entries
+    // are keyed by path, size, mtime and language flags, and laid out as a fixed header, an array of
+    // fixed-size token records and a string pool, so loading one is a single mapping and a linear walk.
+    struct token_cache {
+        token_cache(std::string directory) : directory(std::move(directory)) {
+            boost::system::error_code ec;
+            boost::filesystem::create_directories(this->directory, ec);
+        }
+
+        template <class TokenT>
+        std::shared_ptr<token_stream<TokenT>> load(std::string const& filename, boost::wave::language_support language) {
+            using position_type = typename TokenT::position_type;
+            using string_type = typename TokenT::string_type;
+            namespace ip = boost::interprocess;
+
+            auto key = file_key(filename, language);
+            if (!key) return nullptr;
+
+            auto entry = entry_file(filename, language);
+            boost::system::error_code ec;
+            if (!boost::filesystem::exists(entry, ec)) return nullptr;
+
+            try {
+                auto mapping = ip::file_mapping(entry.c_str(), ip::read_only);
+                auto region = ip::mapped_region(mapping, ip::read_only);
+
+                auto const* base = static_cast<char const*>(region.get_address());
+                auto size = region.get_size();
+                if (size < sizeof(entry_header)) return nullptr;
+
+                auto header = entry_header();
+                std::memcpy(&header, base, sizeof(header));
+                if (std::memcmp(header.magic, magic, sizeof(header.magic)) != 0
+                        || header.size != key->size || header.mtime != key->mtime || header.language != key->language) {
+                    return nullptr;
+                }
+
+                auto records_size = std::uint64_t(header.token_count) * sizeof(token_record);
+                if (size < sizeof(entry_header) + records_size + header.strings_size) return nullptr;
+
+                auto const* records = reinterpret_cast<token_record const*>(base + sizeof(entry_header));
+                auto const* strings = base + sizeof(entry_header) + records_size;
+                if (std::uint64_t(header.path_length) + header.guard_length > header.strings_size
+                        || filename.compare(0, std::string::npos, strings, header.path_length) != 0) {
+                    return nullptr;
+                }
+
+                auto stream = std::make_shared<token_stream<TokenT>>();
+                stream->has_guard = header.has_guard != 0;
+                stream->guard.assign(strings + header.path_length, header.guard_length);
+
+                auto file = string_type(filename.c_str());
+                stream->tokens.reserve(header.token_count);
+                for (std::uint32_t i = 0; i != header.token_count; ++i) {
+                    auto const& record = records[i];
+                    if (std::uint64_t(record.offset) + record.length > header.strings_size) return nullptr;
+
+                    stream->tokens.emplace_back(
+                        boost::wave::token_id(record.id),
+                        string_type(strings + record.offset, record.length),
+                        position_type(file, record.line, record.column));
+                }
+                return stream;
+            } catch (ip::interprocess_exception const&) {
+                return nullptr;
+            }
+        }
+
+        template <class TokenT>
+        void store(std::string const& filename, boost::wave::language_support language, token_stream<TokenT> const& stream) {
+            auto key = file_key(filename, language);
+            if (!key) return;
+
+            auto header = entry_header();
+            std::memcpy(header.magic, magic, sizeof(header.magic));
+            header.size = key->size;
+            header.mtime = key->mtime;
+            header.language = key->language;
+            header.token_count = static_cast<std::uint32_t>(stream.tokens.size());
+            header.path_length = static_cast<std::uint32_t>(filename.size());
+            header.guard_length = static_cast<std::uint32_t>(stream.guard.size());
+            header.has_guard = stream.has_guard;
+
+            auto strings = filename + stream.guard;
+            auto offsets = std::unordered_map<std::string, std::uint32_t>();
+            auto records = std::vector<token_record>();
+            records.reserve(stream.tokens.size());
+            for (auto const& token : stream.tokens) {
+                auto value = std::string(token.get_value().c_str(), token.get_value().size());
+                auto [it, inserted] = offsets.try_emplace(value, static_cast<std::uint32_t>(strings.size()));
+                if (inserted) strings += value;
+
+                auto const& pos = token.get_position();
+                records.push_back({
+                    static_cast<std::uint32_t>(boost::wave::token_id(token)),
+                    it->second,
+                    static_cast<std::uint32_t>(value.size()),
+                    static_cast<std::uint32_t>(pos.get_line()),
+                    static_cast<std::uint32_t>(pos.get_column())});
+            }
+            header.strings_size = strings.size();
+
+            auto entry = entry_file(filename, language);
+            auto temp_file = entry.string() + ".tmp";
+            {
+                std::ofstream out(temp_file, std::ios::binary | std::ios::trunc);
+                if (!out) return;
+
+                out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+                out.write(reinterpret_cast<char const*>(records.data()), records.size() * sizeof(token_record));
+                out.write(strings.data(), strings.size());
+                if (!out) return;
+            }
+
+            boost::system::error_code ec;
+            boost::filesystem::rename(temp_file, entry, ec);
+        }
+
+    private:
+        static constexpr char magic[8] = {'p', 'p', 's', 't', 'o', 'k', 0, 1};
+
+        struct entry_header {
+            char magic[8];
+            std::uint64_t size;
+            std::int64_t mtime;
+            std::uint64_t language;
+            std::uint32_t token_count;
+            std::uint32_t path_length;
+            std::uint32_t guard_length;
+            std::uint32_t has_guard;
+            std::uint64_t strings_size;
+        };
+
+        struct token_record {
+            std::uint32_t id;
+            std::uint32_t offset;
+            std::uint32_t length;
+            std::uint32_t line;
+            std::uint32_t column;
+        };
+
+        struct key_type {
+            std::uint64_t size;
+            std::int64_t mtime;
+            std::uint64_t language;
+        };
+
+        static std::optional<key_type> file_key(std::string const& filename, boost::wave::language_support language) {
+            boost::system::error_code ec;
+            auto size = boost::filesystem::file_size(filename, ec);
+            if (ec) return {};
+            auto mtime = boost::filesystem::last_write_time(filename, ec);
+            if (ec) return {};
+            return key_type{size, static_cast<std::int64_t>(mtime), static_cast<std::uint64_t>(language)};
+        }
+
+        boost::filesystem::path entry_file(std::string const& filename, boost::wave::language_support language) const {
+            std::ostringstream name;
+            name << std::hex << std::setw(16) << std::setfill('0')
+                 << std::hash<std::string>()(filename + '\0' + std::to_string(static_cast<std::uint64_t>(language)))
+                 << ".tokens";
+            return boost::filesystem::path(directory) / name.str();
+        }
+
+        std::string directory;
+    };
+
+    // Lexer iterator for the Wave context that either lexes lazily, exactly like the stock lex_iterator, or
+    // replays a token stream that was lexed ahead of time.
+    template <class TokenT>
+    struct cached_lex_iterator
+        : boost::iterator_facade<cached_lex_iterator<TokenT>, TokenT const, std::forward_iterator_tag> {
+        using token_type = TokenT;
+        using lexer_type = boost::wave::cpplexer::lex_iterator<TokenT>;
+        using position_type = typename TokenT::position_type;
+
+        cached_lex_iterator() : index(0) {}
+
+        template <class IteratorT>
+        cached_lex_iterator(IteratorT const& first, IteratorT const& last, position_type const& pos, boost::wave::language_support language)
+            : lexer(first, last, pos, language), index(0) {}
+
+        explicit cached_lex_iterator(std::shared_ptr<token_stream<TokenT>> stream) : stream(std::move(stream)), index(0) {}
+
+        // Mirrors lex_iterator::set_position: the current token moves to the given file and line, and lines of
+        // the tokens after it are renumbered to follow on from there.
+        void set_position(position_type const& pos) {
+            if (!stream) {
+                lexer.set_position(pos);
+                return;
+            }
+
+            auto& tokens = stream->tokens;
+            if (index >= tokens.size()) return;
+
+            auto& current = tokens[index];
+            auto next_line = pos.get_line();
+            if (current.get_value().find_first_of('\n') != TokenT::string_type::npos) ++next_line;
+
+            auto currpos = current.get_position();
+            currpos.set_file(pos.get_file());
+            currpos.set_line(pos.get_line());
+            current.set_position(currpos);
+
+            if (index + 1 == tokens.size()) return;
+
+            auto base_line = tokens[index + 1].get_position().get_line();
+            for (auto i = index + 1; i != tokens.size(); ++i) {
+                auto tokpos = tokens[i].get_position();
+                tokpos.set_file(pos.get_file());
+                tokpos.set_line(tokpos.get_line() - base_line + next_line);
+                tokens[i].set_position(tokpos);
+            }
+        }
+
+        // Called by the directive grammar to release the lexer's lookahead buffer.
+        void clear_queue() {
+            if (!stream) lexer.clear_queue();
+        }
+
+        bool has_include_guards(std::string& guard_name) const {
+            if (!stream) return lexer.has_include_guards(guard_name);
+
+            if (stream->has_guard) guard_name = stream->guard;
+            return stream->has_guard;
+        }
+
+    private:
+        friend class boost::iterator_core_access;
+
+        TokenT const& dereference() const {
+            return stream ? stream->tokens[index] : *lexer;
+        }
+
+        void increment() {
+            if (stream) ++index; else ++lexer;
+        }
+
+        bool at_end() const {
+            return stream ? index == stream->tokens.size() : lexer == lexer_type();
+        }
+
+        bool equal(cached_lex_iterator const& rhs) const {
+            if (stream && rhs.stream) return stream == rhs.stream ? index == rhs.index : at_end() && rhs.at_end();
+            if (stream || rhs.stream) return at_end() && rhs.at_end();
+            return lexer == rhs.lexer;
+        }
+
+        lexer_type lexer;
+        std::shared_ptr<token_stream<TokenT>> stream;
+        std::size_t index;
+    };
+
+    // Input policy for the Wave context that serves included files out of the server's token cache, lexing
+    // and storing them on a miss. Without a cache it behaves like load_file_to_string.
+    struct load_file_cached {
+        template <typename IterContextT>
+        class inner {
+        public:
+            template <typename PositionT>
+            static void init_iterators(IterContextT& iter_ctx, PositionT const& act_pos, boost::wave::language_support language) {
+                using iterator_type = typename IterContextT::iterator_type;
+                using token_type = typename iterator_type::token_type;
+
+                auto* cache = iter_ctx.ctx.get_hooks().tokens;
+                auto filename = std::string(iter_ctx.filename.c_str());
+
+                if (cache) {
+                    if (auto stream = cache->template load<token_type>(filename, language)) {
+                        iter_ctx.first = iterator_type(std::move(stream));
+                        iter_ctx.last = iterator_type();
+                        return;
+                    }
+                }
+
+                auto* prefetch = iter_ctx.ctx.get_hooks().prefetch;
+                auto contents = prefetch ? prefetch->take(filename) : std::nullopt;
+                if (contents) {
+                    iter_ctx.instring = std::move(*contents);
+                } else {
+                    boost::filesystem::ifstream instream(iter_ctx.filename.c_str());
+                    if (!instream.is_open()) {
+                        BOOST_WAVE_THROW_CTX(iter_ctx.ctx, boost::wave::preprocess_exception,
+                            bad_include_file, iter_ctx.filename.c_str(), act_pos);
+                        return;
+                    }
+                    instream.unsetf(std::ios::skipws);
+
+                    iter_ctx.instring.assign(
+                        std::istreambuf_iterator<char>(instream.rdbuf()),
+                        std::istreambuf_iterator<char>());
+
+                    if (prefetch) prefetch->scan(filename, iter_ctx.instring);
+                }
+
+                if (cache) {
+                    // lex the whole file up front so it can be stored; a file that does not lex cleanly is
+                    // left to the lazy lexer, so that the error is raised where preprocessing reaches it
+                    try {
+                        auto stream = std::make_shared<token_stream<token_type>>();
+                        auto lexer = typename iterator_type::lexer_type(
+                            iter_ctx.instring.begin(), iter_ctx.instring.end(), PositionT(iter_ctx.filename), language);
+                        for (auto it = lexer, end = decltype(lexer)(); it != end; ++it) {
+                            stream->tokens.push_back(*it);
+                        }
+                        stream->has_guard = lexer.has_include_guards(stream->guard);
+
+                        cache->store(filename, language, *stream);
+                        iter_ctx.first = iterator_type(std::move(stream));
+                        iter_ctx.last = iterator_type();
+                        return;
+                    } catch (boost::wave::cpplexer::lexing_exception const&) {
+                        ;
+                    }
+                }
+
+                iter_ctx.first = iterator_type(
+                    iter_ctx.instring.begin(), iter_ctx.instring.end(),
+                    PositionT(iter_ctx.filename), language);
+                iter_ctx.last = iterator_type();
+            }
+
+        private:
+            std::string instring;
+        };
+    };
+}
+
+#endif // PPSTEP_TOKEN_CACHE_HPP
@@ -4,7 +4,16 @@
 #include <vector>
 #include <string>
 #include <variant>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <regex>
+#include <sstream>
+#include <fstream>
+#include <cctype>
 #include <cstdlib>
+#include <charconv>
+#include <limits>
 
 #include <boost/wave/grammars/cpp_grammar_gen.hpp>
 
@@ -16,6 +25,15 @@
 
 #include "client_fwd.hpp"
 #include "server_fwd.hpp"
+#include "macro_index.hpp"
+#include "protocol.hpp"
+#include "watchdog.hpp"
+#include "hook_timings.hpp"
+#include "progress.hpp"
+#include "compact_token.hpp"
+#include "token_automaton.hpp"
+#include "expansion_recording.hpp"
+#include "event_feed.hpp"
 #include "utils.hpp"
 
 
@@ -34,6 +52,36 @@ namespace ppstep::detail {
         
         return true;
     }
+
+    // Where the prompt gets its commands from. Anything with linenoise's signature will do, as long as it
+    // returns a line allocated with malloc, or null at the end of input.
+    using line_reader = char* (*)(char const* prompt);
+
+    inline line_reader& read_line() {
+        static line_reader reader = linenoise;
+        return reader;
+    }
+
+    inline macro_index const*& completion_index() {
+        static macro_index const* index = nullptr;
+        return index;
+    }
+
+    inline void complete_macro_name(char const* buffer, linenoiseCompletions* completions) {
+        auto line = std::string(buffer);
+        auto word_start = line.size();
+        while (word_start != 0 && (std::isalnum(static_cast<unsigned char>(line[word_start - 1])) || line[word_start - 1] == '_')) {
+            --word_start;
+        }
+        if (word_start == line.size() || !completion_index()) return;
+
+        auto head = line.substr(0, word_start);
+        std::size_t remaining = 64;
+        completion_index()->for_each_with_prefix(std::string_view(line).substr(word_start), [&](macro_info const& info) {
+            linenoiseAddCompletion(completions, (head + info.name).c_str());
+            return --remaining != 0;
+        });
+    }
 }
 
 namespace ppstep {
@@ -42,7 +90,16 @@ namespace ppstep {
     template <class TokenT, class ContainerT>
     struct client_cli {
 
-        client_cli(client<TokenT, ContainerT>& cl, std::string prefix) : cl(cl), steps_requested(0), prefix(std::move(prefix)) {}
+        client_cli(client<TokenT, ContainerT>& cl, std::string prefix)
+            : cl(cl), steps_requested(0), prefix(std::move(prefix)), channel(nullptr), response(nullptr), expansion_cache_generation(0) {}
+
+        void set_channel(protocol_channel* ch) {
+            channel = ch;
+        }
+
+        protocol_channel* get_channel() const {
+            return channel;
+        }
 
         template <class Attr>
         void step(Attr const& attr) {
@@ -63,10 +120,144 @@ namespace ppstep {
             cl.remove_breakpoint({attr.begin(), attr.end()}, cond);
         }
 
+        template <class Attr>
+        void set_trace_scope(Attr const& attr) {
+            auto names = std::string(attr.begin(), attr.end());
+            std::replace(names.begin(), names.end(), ',', ' ');
+
+            auto scope = std::set<typename TokenT::string_type>();
+            std::istringstream ss(names);
+            for (std::string name; ss >> name;) {
+                scope.insert(name.c_str());
+            }
+            cl.set_trace_scope(std::move(scope));
+        }
+
+        void clear_trace_scope() {
+            cl.set_trace_scope({});
+        }
+
+        void show_trace_scope() {
+            auto const& scope = cl.get_state().trace_scope;
+            if (scope.empty()) {
+                std::cout << "Tracing all macros." << std::endl;
+                return;
+            }
+
+            std::cout << "Tracing only inside:";
+            for (auto const& name : scope) {
+                std::cout << ' ' << name;
+            }
+            std::cout << std::endl;
+        }
+
+        template <class Attr>
+        void set_limit(Attr const& attr) {
+            auto const& kind = boost::fusion::at_c<0>(attr);
+            auto value = boost::fusion::at_c<2>(attr);
+            auto& limits = cl.get_limits();
+            auto name = std::string(kind.begin(), kind.end());
+            if (name == "depth") limits.depth = value;
+            else if (name == "tokens") limits.tokens = value;
+            else if (name == "events") limits.events = value;
+            else if (name == "time") limits.time = std::chrono::seconds(value);
+        }
+
+        void show_limits() {
+            std::cout << "Limits:\n";
+            cl.get_state().watchdog.print(std::cout);
+        }
+
+        template <class ContextT, class Attr>
+        void add_watchpoint(ContextT& ctx, Attr const& attr) {
+            using position_type = typename ContextT::position_type;
+            using lexer_type = typename ContextT::lexer_type;
+
+            auto text = std::string(attr.begin(), attr.end());
+            auto pattern = token_automaton::pattern_type();
+            try {
+                auto& table = token_table::local();
+                for (auto it = lexer_type(text.begin(), text.end(), position_type("<watch>"), ctx.get_language()), end = lexer_type(); it != end; ++it) {
+                    if (IS_CATEGORY(*it, boost::wave::WhiteSpaceTokenType) || IS_CATEGORY(*it, boost::wave::EOFTokenType)
+                            || IS_CATEGORY(*it, boost::wave::EOLTokenType)) {
+                        continue;
+                    }
+                    pattern.push_back(table.intern(std::string_view(it->get_value().c_str(), it->get_value().size())));
+                }
+            } catch (boost::wave::cpplexer::lexing_exception const& e) {
+                std::cout << e.description() << std::endl;
+                return;
+            }
+
+            if (pattern.empty()) {
+                std::cout << "Nothing to watch." << std::endl;
+                return;
+            }
+
+            auto id = cl.add_watchpoint(pattern);
+            std::cout << "Watchpoint " << id << ": " << spell_tokens(pattern) << std::endl;
+        }
+
+        template <class Attr>
+        void remove_watchpoint(Attr const& attr) {
+            if (!cl.remove_watchpoint(attr)) {
+                std::cout << "No watchpoint number " << attr << '.' << std::endl;
+            }
+        }
+
+        void show_watchpoints() {
+            auto const& watchpoints = cl.get_watchpoints();
+            if (watchpoints.empty()) {
+                std::cout << "No watchpoints." << std::endl;
+                return;
+            }
+            for (auto const& [id, pattern] : watchpoints) {
+                std::cout << id << ": " << spell_tokens(pattern) << '\n';
+            }
+            std::cout << std::flush;
+        }
+
+        void show_hook_timings() {
+#if PPSTEP_HOOK_TIMINGS
+            hook_timings::local().print(std::cout);
+#else
+            std::cout << "Hook timings were compiled out of this build." << std::endl;
+#endif
+        }
+
+        void reset_hook_timings() {
+            hook_timings::local().reset();
+        }
+
+        void set_collapse_threshold(std::size_t tokens) {
+            cl.set_collapse_threshold(tokens);
+        }
+
+        void show_collapse_threshold() {
+            if (auto threshold = cl.get_collapse_threshold()) {
+                std::cout << "Collapsing expansions that call no other macro and produce at most " << threshold << " tokens." << std::endl;
+            } else {
+                std::cout << "Not collapsing expansions." << std::endl;
+            }
+        }
+
         void step_continue() {
             steps_requested = 1;
             cl.set_mode(stepping_mode::UNTIL_BREAK);
         }
+
+        void step_next() {
+            steps_requested = 1;
+            cl.step_over();
+        }
+
+        void step_finish() {
+            if (!cl.step_out()) {
+                std::cout << "Not inside a macro expansion." << std::endl;
+                return;
+            }
+            steps_requested = 1;
+        }
         
         template <class ContextT, class Attr>
         void expand_macro(ContextT& ctx, Attr const& attr) {
@@ -78,19 +269,59 @@ namespace ppstep {
             
             auto begin = lex_iterator_type(macro.begin(), macro.end(), position_type("<command line>"), ctx.get_language());
             auto end = lex_iterator_type();
-            
+
+            // the same tokens under the same macro definitions expand the same way every time; where whitespace
+            // separated them matters too, since # spells it out
+            auto key = std::string();
+            bool spaced = false;
+            for (auto it = begin; it != end; ++it) {
+                if (IS_CATEGORY(*it, boost::wave::WhiteSpaceTokenType) || IS_CATEGORY(*it, boost::wave::EOLTokenType)) {
+                    spaced = true;
+                    continue;
+                }
+                if (IS_CATEGORY(*it, boost::wave::EOFTokenType)) continue;
+                key += spaced ? '\x01' : '\x00';
+                key += it->get_value().c_str();
+                spaced = false;
+            }
+
+            auto generation = cl.get_state().macros->generation();
+            if (generation != expansion_cache_generation) {
+                expansion_cache.clear();
+                expansion_cache_generation = generation;
+            }
+
+            auto new_state = server_state<ContainerT>();
+            new_state.macros = cl.get_state().macros;
+            auto new_client = client<TokenT, ContainerT>(new_state, macro);
+            new_client.set_protocol(channel);
+
+            auto cached = expansion_cache.find(key);
+            if (cached != expansion_cache.end()) {
+                cached->second.replay(ctx, new_client, new_state);
+                return;
+            }
+
             token_sequence_type pending;
             token_sequence_type expanded;
             bool seen_newline;
-            
-            auto old_hooks = std::move(ctx.get_hooks());
 
-            auto new_state = server_state<ContainerT>();
-            auto new_client = client<TokenT, ContainerT>(new_state, macro);
-            ctx.get_hooks() = server<TokenT, ContainerT>(new_state, new_client);
-            auto token = ctx.expand_tokensequence(begin, end, pending, expanded, seen_newline);
+            auto recording = expansion_recording<TokenT, ContainerT>();
+            new_client.record_into(&recording);
 
+            auto old_hooks = std::move(ctx.get_hooks());
+            ctx.get_hooks() = server<TokenT, ContainerT>(new_state, new_client);
+            try {
+                ctx.expand_tokensequence(begin, end, pending, expanded, seen_newline);
+            } catch (...) {
+                ctx.get_hooks() = std::move(old_hooks);
+                throw;
+            }
             ctx.get_hooks() = std::move(old_hooks);
+
+            if (!recording.is_repeatable()) return;
+            if (expansion_cache.size() >= max_cached_expansions) expansion_cache.clear();
+            expansion_cache.emplace(std::move(key), std::move(recording));
         }
         
         template <class Context, class Attr>
@@ -114,46 +345,134 @@ namespace ppstep {
             detail::parse_pp_declaration(ctx, decl);
         }
         
-        template <class Context>
-        void show_macros(Context const& ctx) {
-            for (auto it = ctx.macro_names_begin(); it != ctx.macro_names_end(); ++it) {
-                if (it->rfind("__", 0) == 0) continue; // predefined macro
-
-                bool has_params, is_predefined;
-                typename Context::position_type pos;
-                std::vector<typename Context::token_type> parameters;
-                typename Context::token_sequence_type definition;
-                ctx.get_macro_definition(*it, has_params, is_predefined, pos, parameters, definition);
-                
-                std::cout << " - " << *it;
-                if (has_params) {
-                    std::cout << '(';
-
-                    auto params_it = parameters.begin();
-                    auto params_end = parameters.end();
+        template <class Attr>
+        void show_macros(Attr const& attr) {
+            auto filter = std::string();
+            std::size_t page = 1;
+            if (attr) {
+                auto const& arg = boost::fusion::at_c<1>(*attr);
+                std::istringstream ss(std::string(arg.begin(), arg.end()));
+                for (std::string word; ss >> word;) {
+                    if (std::all_of(word.begin(), word.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+                        auto [end, ec] = std::from_chars(word.data(), word.data() + word.size(), page);
+                        // pages are numbered from 1, and the last macro on a page has to be countable
+                        if (ec != std::errc() || page == 0 || page > std::numeric_limits<std::size_t>::max() / macros_page_size) {
+                            std::cout << "Invalid page number \"" << word << "\"" << std::endl;
+                            return;
+                        }
+                    } else {
+                        filter = word;
+                    }
+                }
+            }
 
-                    if (params_it != params_end)
-                        std::cout << (params_it++)->get_value();
+            auto const& macros = *(cl.get_state().macros);
+            auto const argument = filter;
 
-                    for (; params_it != params_end; ++params_it)
-                        std::cout << ", " << params_it->get_value();
+            std::optional<std::regex> pattern;
+            if (filter.size() >= 2 && filter.front() == '/' && filter.back() == '/') {
+                try {
+                    pattern = std::regex(filter.substr(1, filter.size() - 2));
+                } catch (std::regex_error const& e) {
+                    std::cout << "Invalid macro pattern \"" << filter << "\": " << e.what() << std::endl;
+                    return;
+                }
+                filter.clear();
+            }
 
-                    std::cout << ')';
+            auto first = (page - 1) * macros_page_size;
+            auto last = first + macros_page_size;
+            std::size_t matched = 0;
+            macros.for_each_with_prefix(filter, [&](macro_info const& info) {
+                if (info.name.rfind("__", 0) == 0) return true; // predefined macro
+                if (pattern && !std::regex_search(info.name, *pattern)) return true;
 
+                if (matched >= first && matched < last) {
+                    std::cout << " - ";
+                    info.print_signature(std::cout) << " " << info.definition << '\n';
                 }
-                
-                std::cout << " ";
-                for (auto const& token : definition) {
-                    std::cout << token.get_value();
-                }
-                std::cout << '\n';
+                ++matched;
+                return true;
+            });
+
+            if (first >= matched && page > 1) {
+                auto pages = (matched + macros_page_size - 1) / macros_page_size;
+                std::cout << "No page " << page << " (" << matched << (matched == 1 ? " macro in " : " macros in ") << pages << (pages == 1 ? " page" : " pages") << ")\n";
+            } else if (matched > last) {
+                std::cout << "(showing " << first + 1 << '-' << last << " of " << matched << " macros, use \"macros "
+                          << (argument.empty() ? "" : argument + ' ') << page + 1 << "\" for more)\n";
             }
             std::cout << std::flush;
         }
+
+        template <class Attr>
+        void show_macro_info(Attr const& attr) {
+            auto name = std::string(attr.begin(), attr.end());
+            name.erase(name.find_last_not_of(' ') + 1);
+
+            auto const* info = cl.get_state().macros->find(name);
+            if (!info) {
+                std::cout << "No macro named \"" << name << "\" is defined." << std::endl;
+                return;
+            }
+
+            info->print_signature(std::cout) << " " << info->definition << '\n';
+            std::cout << "  " << (info->is_functionlike ? "function-like" : "object-like")
+                      << (info->is_predefined ? ", predefined" : "") << '\n';
+            std::cout << "  defined at " << info->file << ':' << info->line << ':' << info->column << std::endl;
+        }
         
+        template <class Attr>
+        void show_macro_references(Attr const& attr, bool users) {
+            auto name = std::string(attr.begin(), attr.end());
+            name.erase(name.find_last_not_of(' ') + 1);
+
+            auto const& macros = *(cl.get_state().macros);
+            if (!users && !macros.find(name)) {
+                std::cout << "No macro named \"" << name << "\" is defined." << std::endl;
+                return;
+            }
+
+            auto found = users ? macros.used_by(name) : macros.uses(name);
+            if (found.empty()) {
+                std::cout << (users ? "No macro uses \"" : "No other macro is used by \"") << name << "\"." << std::endl;
+                return;
+            }
+            for (auto const* info : found) {
+                std::cout << " - ";
+                info->print_signature(std::cout) << " " << info->definition << '\n';
+            }
+            std::cout << std::flush;
+        }
+
+        template <class Attr>
+        void write_macro_graph(Attr const& attr) {
+            std::istringstream ss(std::string(attr.begin(), attr.end()));
+            auto file = std::string();
+            auto around = std::string();
+            ss >> file >> around;
+
+            std::ofstream out(file);
+            if (!out) {
+                std::cout << "Cannot open \"" << file << "\" for writing." << std::endl;
+                return;
+            }
+            cl.get_state().macros->write_dot(out, around);
+            std::cout << "Wrote the macro reference graph" << (around.empty() ? "" : " around " + around) << " to " << file << '.' << std::endl;
+        }
+
         void expanding_trace() {
             auto const& expanding = cl.get_state().expanding;
 
+            if (response) {
+                response->key("backtrace").begin_array();
+                for (auto it = expanding.rbegin(); it != expanding.rend(); ++it) {
+                    response->tokens(*it);
+                }
+                response->end_array();
+                return;
+            }
+
             std::size_t idx = 0;
             for (auto it = expanding.rbegin(); it != expanding.rend(); ++it, ++idx) {
                 std::cout << idx << ": ";
@@ -164,6 +483,16 @@ namespace ppstep {
         void rescanning_trace() {
             auto const& rescanning = cl.get_state().rescanning;
 
+            if (response) {
+                response->key("forwardtrace").begin_array();
+                for (auto it = rescanning.rbegin(); it != rescanning.rend(); ++it) {
+                    auto const& [cause, initial] = *it;
+                    response->begin_object().key("macro").tokens(initial).key("cause").tokens(cause).end_object();
+                }
+                response->end_array();
+                return;
+            }
+
             std::size_t idx = 0;
             for (auto it = rescanning.rbegin(); it != rescanning.rend(); ++it, ++idx) {
                 auto const& [cause, initial] = *it;
@@ -193,6 +522,11 @@ namespace ppstep {
 
         template <class ContextT>
         void current_state(ContextT& ctx) {
+            if (response) {
+                write_state(*response, ctx);
+                return;
+            }
+
             auto latest = cl.newest_history();
             if (latest == cl.oldest_history())
                 return;
@@ -223,10 +557,25 @@ namespace ppstep {
 #define PPSTEP_ACTION(...) ([this, &ctx](auto const& attr){ __VA_ARGS__; })
 
             qi::rule<Iterator, ascii::space_type> grammar =
-                lexeme[(lit("step") | lit("s")) >> -(+space >> uint_)][PPSTEP_ACTION(step(attr))]
+                lexeme[lit("scope") >> +space >> anything[PPSTEP_ACTION(set_trace_scope(attr))]]
+              | lit("scope")[PPSTEP_ACTION(show_trace_scope())]
+              | lit("unscope")[PPSTEP_ACTION(clear_trace_scope())]
+              | lexeme[lit("limit") >> +space >> ((ascii::string("depth") | ascii::string("tokens") | ascii::string("events") | ascii::string("time")) >> +space >> uint_)[PPSTEP_ACTION(set_limit(attr))]]
+              | lit("limit")[PPSTEP_ACTION(show_limits())]
+              | lexeme[lit("watch") >> +space >> anything[PPSTEP_ACTION(add_watchpoint(ctx, attr))]]
+              | lit("watch")[PPSTEP_ACTION(show_watchpoints())]
+              | lexeme[lit("unwatch") > +space > uint_[PPSTEP_ACTION(remove_watchpoint(attr))]]
+              | lexeme[lit("perf") >> +space >> lit("reset")][PPSTEP_ACTION(reset_hook_timings())]
+              | lit("perf")[PPSTEP_ACTION(show_hook_timings())]
+              | lexeme[lit("collapse") >> +space >> uint_[PPSTEP_ACTION(set_collapse_threshold(attr))]]
+              | lexeme[lit("collapse") >> +space >> lit("off")][PPSTEP_ACTION(set_collapse_threshold(0))]
+              | lit("collapse")[PPSTEP_ACTION(show_collapse_threshold())]
+              | lexeme[(lit("step") | lit("s")) >> -(+space >> uint_)][PPSTEP_ACTION(step(attr))]
               | (lit("continue") | lit("c"))[PPSTEP_ACTION(step_continue())]
               | lexeme[(lit("backtrace") | lit("bt"))[PPSTEP_ACTION(expanding_trace())]]
               | lexeme[(lit("forwardtrace") | lit("ft"))[PPSTEP_ACTION(rescanning_trace())]]
+              | (lit("next") | lit("n"))[PPSTEP_ACTION(step_next())]
+              | (lit("finish") | lit("f"))[PPSTEP_ACTION(step_finish())]
               | lexeme[
                   (lit("break") | lit("b")) >> *space > (
                         ((lit("call") | lit("c")) > +space > anything[PPSTEP_ACTION(add_breakpoint(attr, preprocessing_event_type::CALL))])
@@ -248,7 +597,11 @@ namespace ppstep {
               | lexeme[lit("#include") > +space > anything[PPSTEP_ACTION(include_file(ctx, attr))]]
               
               | (lit("what") | lit("?"))[PPSTEP_ACTION(explain_current_state())]
-              | lit("macros")[PPSTEP_ACTION(show_macros(ctx))]
+              | lexeme[lit("macros") >> -(+space >> anything)][PPSTEP_ACTION(show_macros(attr))]
+              | lexeme[lit("info") > +space > anything[PPSTEP_ACTION(show_macro_info(attr))]]
+              | lexeme[lit("uses") > +space > anything[PPSTEP_ACTION(show_macro_references(attr, false))]]
+              | lexeme[lit("used-by") > +space > anything[PPSTEP_ACTION(show_macro_references(attr, true))]]
+              | lexeme[lit("refgraph") > +space > anything[PPSTEP_ACTION(write_macro_graph(attr))]]
               | (lit("quit") | lit("q"))[PPSTEP_ACTION(quit())]
               | eoi[PPSTEP_ACTION(current_state(ctx))];
 
@@ -271,6 +624,18 @@ namespace ppstep {
             if (steps_requested) return;
 
             cl.set_mode(stepping_mode::FREE);
+            cl.pause_progress();
+            clear_interrupt();
+
+            if (auto* feed = cl.get_state().feed) feed->stopped(trigger, cl.get_state());
+
+            PPSTEP_PAUSE_HOOK_TIMERS();
+
+            if (channel) {
+                serve_requests(ctx, trigger);
+                cl.resume_watchdog();
+                return;
+            }
 
             if (print_state) current_state(ctx);
 
@@ -283,7 +648,10 @@ namespace ppstep {
             }
             prompt += "> ";
 
-            for (char* raw_line; (raw_line = linenoise(prompt.c_str())) != nullptr;) {
+            detail::completion_index() = cl.get_state().macros.get();
+            linenoiseSetCompletionCallback(detail::complete_macro_name);
+
+            for (char* raw_line; (raw_line = detail::read_line()(prompt.c_str())) != nullptr;) {
                 linenoiseHistoryAdd(raw_line);
 
                 bool valid = parse(ctx, raw_line, raw_line + std::strlen(raw_line));
@@ -297,12 +665,193 @@ namespace ppstep {
                     if (steps_requested) break;
                 }
             }
+
+            cl.resume_watchdog();
+        }
+
+        template <class ContextT>
+        void report_start(ContextT& ctx) {
+            if (!channel) {
+                std::cout << "Preprocessing " << ctx.get_main_pos() << '.' << std::endl;
+                return;
+            }
+
+            auto w = json_writer();
+            w.begin_object()
+                .key("type").value("hello")
+                .key("protocol").value("ppstep")
+                .key("version").value(protocol_channel::version)
+                .key("file").value(ctx.get_main_pos().get_file().c_str())
+                .end_object();
+            channel->send(w.buffer);
+        }
+
+        template <class ExceptionT>
+        void report_exception(ExceptionT const& e) {
+            cl.pause_progress();
+            if (!channel) {
+                std::cout << e.what() << ": " << e.description() << std::endl;
+                return;
+            }
+
+            auto w = json_writer();
+            w.begin_object()
+                .key("type").value("exception")
+                .key("what").value(e.what())
+                .key("description").value(e.description())
+                .end_object();
+            channel->send(w.buffer);
+        }
+
+        void report_limit(std::string const& message) {
+            cl.pause_progress();
+            if (!channel) {
+                std::cout << "Stopped: " << message << '.' << std::endl;
+                expanding_trace();
+                rescanning_trace();
+                return;
+            }
+
+            auto w = json_writer();
+            w.begin_object().key("type").value("limit").key("message").value(message);
+            response = &w;
+            expanding_trace();
+            rescanning_trace();
+            response = nullptr;
+            w.end_object();
+            channel->send(w.buffer);
+        }
+
+        void report_watchpoint(std::size_t id, token_automaton::pattern_type const& pattern) {
+            cl.pause_progress();
+            if (!channel) {
+                std::cout << "Stopped: watchpoint " << id << " matched " << spell_tokens(pattern) << '.' << std::endl;
+                return;
+            }
+
+            auto& table = token_table::local();
+            auto w = json_writer();
+            w.begin_object().key("type").value("watchpoint").key("id").value(id).key("tokens").begin_array();
+            for (auto token : pattern) w.value(table.string(token));
+            w.end_array().end_object();
+            channel->send(w.buffer);
+        }
+
+        // Prompts regardless of any pending steps or breakpoints.
+        template <class ContextT>
+        void interrupt(ContextT& ctx, std::string const& trigger) {
+            steps_requested = 0;
+            prompt(ctx, trigger);
+        }
+
+        template <class ContextT>
+        void stream_event(ContextT& ctx) {
+            if (!channel) return;
+
+            auto latest = cl.newest_history();
+            if (latest == cl.oldest_history()) return;
+
+            auto w = json_writer();
+            w.begin_object();
+            if (!prefix.empty()) w.key("session").value(prefix);
+            w.key("position").position(ctx.get_main_pos());
+            std::visit([&w, &latest](auto const& event){ event.write(w, latest->tokens); }, latest->event);
+            w.end_object();
+            channel->add_event(w.buffer);
         }
 
     private:
+        static constexpr std::size_t macros_page_size = 50;
+        static constexpr std::size_t max_cached_expansions = 64;
+
+        static std::string spell_tokens(token_automaton::pattern_type const& pattern) {
+            auto& table = token_table::local();
+            auto acc = std::string();
+            for (auto token : pattern) {
+                if (!acc.empty()) acc += ' ';
+                acc += table.string(token);
+            }
+            return acc;
+        }
+
+        template <class ContextT>
+        void write_state(json_writer& w, ContextT& ctx) {
+            w.key("position").position(ctx.get_main_pos());
+
+            auto latest = cl.newest_history();
+            if (latest == cl.oldest_history())
+                return;
+
+            w.key("state").begin_object();
+            std::visit([&w, &latest](auto const& event){ event.write(w, latest->tokens); }, latest->event);
+            w.key("line").tokens(latest->tokens);
+            w.end_object();
+        }
+
+        template <class ContextT>
+        void serve_requests(ContextT& ctx, std::string const& trigger) {
+            {
+                auto w = json_writer();
+                w.begin_object().key("type").value("stopped");
+                if (!prefix.empty()) w.key("session").value(prefix);
+                w.key("reason").value(trigger);
+                write_state(w, ctx);
+                w.end_object();
+                channel->send(w.buffer);
+            }
+
+            while (auto request = channel->receive()) {
+                auto w = json_writer();
+                w.begin_object().key("type").value("response");
+                if (request->id) {
+                    auto const& id = *(request->id);
+                    bool numeric = !id.empty() && std::all_of(id.begin(), id.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); });
+                    if (numeric) w.key("id").raw(id); else w.key("id").value(id);
+                }
+
+                // anything printed as plain text is captured and returned alongside the structured fields
+                std::ostringstream captured;
+                auto* old_buffer = std::cout.rdbuf(captured.rdbuf());
+                response = &w;
+
+                bool valid = false;
+                bool terminated = false;
+                try {
+                    valid = parse(ctx, request->command.data(), request->command.data() + request->command.size());
+                } catch (session_terminate const&) {
+                    valid = terminated = true;
+                } catch (...) {
+                    response = nullptr;
+                    std::cout.rdbuf(old_buffer);
+                    throw;
+                }
+
+                response = nullptr;
+                std::cout.rdbuf(old_buffer);
+
+                static auto const ansi_escape = std::regex("\x1b\\[[0-9;]*m");
+                w.key("ok").value(valid)
+                 .key("output").value(std::regex_replace(captured.str(), ansi_escape, ""))
+                 .end_object();
+                channel->send(w.buffer);
+
+                if (terminated) throw session_terminate();
+                if (valid && steps_requested) return;
+            }
+
+            throw session_terminate();
+        }
+
         client<TokenT, ContainerT>& cl;
         std::size_t steps_requested;
         std::string prefix;
+
+        protocol_channel* channel;
+        json_writer* response;
+
+        // expand results, valid for one generation of the macro table
+        std::unordered_map<std::string, expansion_recording<TokenT, ContainerT>> expansion_cache;
+        std::size_t expansion_cache_generation;
     };
 }
 
@@ -0,0 +1,97 @@
+#ifndef PPSTEP_WATCHDOG_HPP
+#define PPSTEP_WATCHDOG_HPP
+
+#include <string>
+#include <optional>
+#include <chrono>
+#include <ostream>
+
+namespace ppstep {
+    // A limit of zero means unlimited.
+    struct expansion_limits {
+        std::size_t depth = 0;
+        std::size_t tokens = 0;
+        std::size_t events = 0;
+        std::chrono::seconds time = std::chrono::seconds(0);
+    };
+
+    // Guards against runaway expansions. Each check returns a description of the limit that was crossed, if
+    // any. The event and time budgets start over whenever the user gets control back. The depth and result
+    // limits stay quiet for the rest of the expansion that crossed them, whose calls and enclosing results
+    // would otherwise cross them again, so that preprocessing can be resumed past it.
+    struct expansion_watchdog {
+        using clock = std::chrono::steady_clock;
+
+        expansion_watchdog() : events(0), events_at_resume(0), resumed(clock::now()) {}
+
+        std::optional<std::string> on_event() {
+            ++events;
+
+            if (limits.events && events - events_at_resume > limits.events) {
+                return "event limit of " + std::to_string(limits.events) + " exceeded";
+            }
+
+            // reading the clock is comparatively expensive, so only do it every so often
+            if (limits.time.count() && (events & 0xff) == 0 && clock::now() - resumed > limits.time) {
+                return "time limit of " + std::to_string(limits.time.count()) + "s exceeded";
+            }
+
+            return {};
+        }
+
+        // For a call, with the depth of the frame it opens. A call no deeper than the frame that last crossed
+        // the depth limit means that frame is done; one at the top level means the whole expansion is.
+        std::optional<std::string> on_depth(std::size_t depth) {
+            if (depth <= 1) result_tripped.reset();
+
+            if (depth_tripped && depth > *depth_tripped) return {};
+            depth_tripped.reset();
+
+            if (!limits.depth || depth <= limits.depth) return {};
+
+            depth_tripped = depth;
+            return "expansion depth limit of " + std::to_string(limits.depth) + " exceeded";
+        }
+
+        // For an expansion or rescan result, with the depth of the frame that produced it.
+        std::optional<std::string> on_result(std::size_t tokens, std::size_t depth) {
+            if (!limits.tokens || tokens <= limits.tokens) return {};
+            if (result_tripped && depth <= *result_tripped) return {}; // contains the result that tripped
+
+            result_tripped = depth;
+            return "expansion result limit of " + std::to_string(limits.tokens) + " tokens exceeded (" + std::to_string(tokens) + " tokens)";
+        }
+
+        // Called whenever the user gets control back, so that time spent at the prompt and events already
+        // stepped through are not held against the next run.
+        void resume() {
+            resumed = clock::now();
+            events_at_resume = events;
+        }
+
+        void print(std::ostream& os) const {
+            auto print_limit = [&os](char const* name, std::size_t value, char const* unit) {
+                os << "  " << name << ": ";
+                if (value) os << value << unit; else os << "unlimited";
+                os << '\n';
+            };
+            print_limit("depth", limits.depth, "");
+            print_limit("tokens", limits.tokens, "");
+            print_limit("events", limits.events, "");
+            print_limit("time", limits.time.count(), "s");
+            os << std::flush;
+        }
+
+        expansion_limits limits;
+
+    private:
+        std::size_t events;
+        std::size_t events_at_resume;
+        clock::time_point resumed;
+
+        std::optional<std::size_t> depth_tripped;
+        std::optional<std::size_t> result_tripped;
+    };
+}
+
+#endif // PPSTEP_WATCHDOG_HPP